@@ -0,0 +1,52 @@
+#!/bin/sh
+# Runs every collector over a range of heap sizes and prints CSV.
+#
+# The minimum live size of each workload is measured first with a
+# big mark-compact heap. Heaps are then sized from 1.5x to 10x that
+# minimum. Each row is:
+#
+#   heap_factor, rep, workload, collector, heap_words, status,
+#   elapsed_ms, work, throughput (work/s), gc_count, gc_ms,
+#   max_pause_ms, max_live_words, peak_rss_kb
+#
+# status is ok, oom (the heap was too small) or error. Each workload
+# is its own program, ./WORKLOAD.exe, and ARGS_WORKLOAD holds its
+# arguments. A workload named PROGRAM_VARIANT runs ./PROGRAM.exe. Settings come from the environment, e.g.
+# REPS=10 WORKLOADS="dkp bintrees" ARGS_dkp=data/dkp.log-small ./bench.sh
+
+ARGS_dkp=${ARGS_dkp:-data/dkp.log-big}
+ARGS_dkp_leaky=${ARGS_dkp_leaky:-"--leaky $ARGS_dkp"}
+ARGS_shards=${ARGS_shards:-$ARGS_dkp}
+REPS=${REPS:-3}
+WORKLOADS=${WORKLOADS:-"dkp dkp_leaky bintrees lru shards"}
+COLLECTORS=${COLLECTORS:-"NO_GC REF_COUNT_GC MARK_SWEEP_GC MARK_COMPACT_GC HYBRID_GC COPY_GC ADAPTIVE_GC IMMIX_GC BAKER_GC BROOKS_GC TREADMILL_GC REGION_GC"}
+FACTORS=${FACTORS:-"1.5 2 3 4 6 8 10"}
+MAX_HEAP=65520
+
+echo "heap_factor,rep,workload,collector,heap_words,status,elapsed_ms,work,throughput,gc_count,gc_ms,max_pause_ms,max_live_words,peak_rss_kb"
+
+for workload in $WORKLOADS; do
+    program=./${workload%%_*}.exe
+    eval args=\$ARGS_$workload
+    min_live=`$program --bench --measure-live --heap=$MAX_HEAP --gc=MARK_COMPACT_GC $args | cut -d, -f11`
+    if [ -z "$min_live" ] || [ "$min_live" -eq 0 ]; then
+        echo "could not measure live size of $workload" >&2
+        exit 1
+    fi
+    for factor in $FACTORS; do
+        heap=`awk "BEGIN { print int($min_live * $factor) }"`
+        if [ $heap -gt $MAX_HEAP ]; then heap=$MAX_HEAP; fi
+        for gc in $COLLECTORS; do
+            rep=1
+            while [ $rep -le $REPS ]; do
+                row=`$program --bench --heap=$heap --gc=$gc $args 2>/dev/null`
+                case $? in
+                    0) echo "$factor,$rep,$row" ;;
+                    3) echo "$factor,$rep,$workload,$gc,$heap,oom,,,,,,,," ;;
+                    *) echo "$factor,$rep,$workload,$gc,$heap,error,,,,,,,," ;;
+                esac
+                rep=`expr $rep + 1`
+            done
+        done
+    done
+done
@@ -0,0 +1,171 @@
+/*
+ * A binary-trees workload after Boehm's GCBench. It builds many
+ * short-lived trees of increasing depth, both top down (parents
+ * before children) and bottom up, while a long-lived tree and array
+ * stay reachable the whole time. That stresses deep marking, the
+ * survival of old objects and copying in ways the dkp program
+ * doesn't.
+ *
+ * It takes the same collector, heap, frame and --bench options as
+ * dkp.exe, plus:
+ *
+ *   --depth=N       deepest short-lived tree (default 8)
+ *   --min-depth=N   shallowest short-lived tree (default 4)
+ *   --long-lived=N  depth of the long-lived tree (default --depth)
+ *   --array=N       length of the long-lived array (default 100)
+ *   --iterations=N  scales the number of trees built at each depth
+ */
+
+#define DKP_NO_MAIN
+#include "dkp.cc"
+
+// Every node is a 2-tuple. Leaves have nil children.
+
+static long nodes_built = 0;
+
+int tree_size(int depth) {
+    return (1 << (depth + 1)) - 1;
+}
+
+// GCBench's Populate: parents are allocated before their children.
+
+void populate(int depth, TupRef &node) {
+    if (depth > 0) {
+        TupRef left(2);
+        TupRef right(2);
+        nodes_built += 2;
+        node.set(0, left);
+        node.set(1, right);
+        populate(depth - 1, left);
+        populate(depth - 1, right);
+    }
+}
+
+// GCBench's MakeTree: children are allocated before their parents.
+
+TupRef make_tree(int depth) {
+    nodes_built += 1;
+    if (depth <= 0) {
+        return TupRef(2);
+    }
+    TupRef left = make_tree(depth - 1);
+    TupRef right = make_tree(depth - 1);
+    TupRef node(2);
+    node.set(0, left);
+    node.set(1, right);
+    return node;
+}
+
+int count_nodes(TupRef node) {
+    int count = 1;
+    for (int i = 0; i < 2; ++i) {
+        ObjRef child = node.get(i);
+        if (child.type() == Obj::TTup) {
+            count += count_nodes(TupRef(child));
+        }
+    }
+    return count;
+}
+
+void time_construction(int depth, int iterations, int max_depth) {
+    int trees = iterations * tree_size(max_depth) / tree_size(depth);
+    for (int i = 0; i < trees; ++i) {
+        TupRef root(2);
+        nodes_built += 1;
+        populate(depth, root);
+    }
+    for (int i = 0; i < trees; ++i) {
+        TupRef root = make_tree(depth);
+    }
+}
+
+int main(int argc, char **argv) {
+    RunOptions options;
+    options.heap_size = 12000;
+    int max_depth = 8;
+    int min_depth = 4;
+    int long_lived_depth = -1;
+    int array_len = 100;
+    int iterations = 2;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (options.parse(argv[i])) {
+            continue;
+        }
+        else if (arg.compare(0, 8, "--depth=") == 0) {
+            max_depth = atoi(argv[i] + 8);
+        }
+        else if (arg.compare(0, 12, "--min-depth=") == 0) {
+            min_depth = atoi(argv[i] + 12);
+        }
+        else if (arg.compare(0, 13, "--long-lived=") == 0) {
+            long_lived_depth = atoi(argv[i] + 13);
+        }
+        else if (arg.compare(0, 8, "--array=") == 0) {
+            array_len = atoi(argv[i] + 8);
+        }
+        else if (arg.compare(0, 13, "--iterations=") == 0) {
+            iterations = atoi(argv[i] + 13);
+        }
+        else {
+            std::cerr << "unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+    if (long_lived_depth < 0) {
+        long_lived_depth = max_depth;
+    }
+    if (min_depth < 0 || max_depth < min_depth || iterations < 1 || array_len < 1) {
+        std::cerr << "need 0 <= min-depth <= depth and a positive array and iterations\n";
+        return 1;
+    }
+    // The stretch tree, one deeper than the rest, and the long-lived
+    // tree each have to fit in the heap on their own. The heap is at
+    // most MaxHeapSize words, so this also caps the depth.
+    int deepest = std::max(max_depth + 1, long_lived_depth);
+    long tree_words = (deepest < 30) ? (long)tree_size(deepest) * Tup::size_needed(2) : MaxHeapSize + 1L;
+    if (tree_words > options.capacity()) {
+        std::cerr << "a tree of depth " << deepest << " doesn't fit in a heap of "
+                  << options.capacity() << " words\n";
+        return 1;
+    }
+
+    Heap *heap = start_run(options);
+    if (!heap) {
+        return 1;
+    }
+
+    {
+        // the stretch tree is garbage right away, but needs the
+        // heap to be big enough for one tree deeper than the rest
+        TupRef stretch = make_tree(max_depth + 1);
+    }
+    heap->log_roots("stretch tree dropped");
+
+    TupRef long_lived(2);
+    nodes_built += 1;
+    populate(long_lived_depth, long_lived);
+    VecRef array(array_len);
+    for (int i = 0; i < array_len; ++i) {
+        NumRef n(i);
+        array.push(n);
+    }
+    heap->log_roots("long-lived data built");
+
+    for (int depth = min_depth; depth <= max_depth; depth += 2) {
+        time_construction(depth, iterations, max_depth);
+        std::ostringstream msg;
+        msg << "depth " << depth << " trees built";
+        heap->log_roots(msg.str());
+    }
+
+    if (count_nodes(long_lived) != tree_size(long_lived_depth) ||
+        array.get(array_len - 1).to_i() != array_len - 1) {
+        std::cerr << "long-lived data was corrupted\n";
+        return 2;
+    }
+
+    finish_run(options, heap, "bintrees", nodes_built);
+    return 0;
+}
@@ -22,25 +22,79 @@
 #include <string>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
 #include <set>
 #include <map>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
+// Default heap size in words; --heap=N picks another. Locs are 16 bits
+// so no heap can be bigger than MaxHeapSize.
 const int HeapSize = 2000;
-const int HeapSemiSize = 1000;
+const int MaxHeapSize = 0xfff0;
 
 const int ImageWordSize = 5;
 const int ImageWidthInWords = 25;
-const int ImageHeight = (HeapSize / ImageWidthInWords) * ImageWordSize;
 const int ImageWidth = ImageWidthInWords * ImageWordSize;
 
+// The heat map draws the whole heap at a fixed resolution no matter
+// how big the heap is. Each cell summarizes a block of words.
+const int HeatMapWidth = 64;
+const int HeatMapHeight = 64;
+const int HeatMapCellSize = 2;
+
+// dkp.exe exits with this when an allocation can't be satisfied even
+// after a collection.
+const int ExitHeapExhausted = 3;
+
+const int LiveSampleInterval = 16;
+
+// Under --mmu a GC quantum is a twentieth of the window, 500us of a
+// 10ms window, made of steps worth a few allocated words. A new cycle
+// starts once less than an eighth of the heap is free, and a cycle
+// more than a thirty-second of the heap behind the steps allocation
+// would have paid for gets those steps anyway.
+const int MetronomeQuantaPerWindow = 20;
+const int MetronomeStepWords = 8;
+const int MetronomeReserveFraction = 8;
+const int MetronomeSlackFraction = 32;
+
+// Heap sizing smooths the GC overhead over recent collections and
+// moves the heap by at most these percentages per collection.
+const int SizingSmoothingPercent = 30;
+const int SizingPauseShrinkPercent = 75; // the last pause was too long
+const int SizingMaxGrowthPercent = 200;
+const int SizingIdleShrinkPercent = 90; // GC took under half its share
+
+// Free pages go back to the OS after a collection, except for about as
+// many free words as the program allocated between recent collections,
+// which it would only fault back in. That demand halves with every
+// collection, so a program that goes quiet gives back more.
+const int ReleaseKeepDecayPercent = 50;
+
 typedef signed short SWd;
 typedef unsigned short UWd;
 typedef unsigned short Loc;
 typedef void (*VisitFn)(Loc loc);
 
+class Heap;
+
 void log_alloc_mem(Loc loc, int size);
 void log_free_mem(Loc loc, int size);
-void log_init_obj(void *addr, const char *type);
+void log_init_obj(void *addr, int type);
 void log_ref_count(Loc loc, int ref_count);
 void log_ref_count(void *addr, int ref_count);
 void log_get_val(const void *addr);
@@ -78,7 +132,7 @@ class Obj {
     } header;
 
     void init(Type type) {
-        log_init_obj(&header, TypeName[type]);
+        log_init_obj(&header, type);
         header.type = type;
         init_ref_count();
         header.mark = 0;
@@ -88,40 +142,15 @@ class Obj {
 
     Type type() const { return (Type)header.type; }
 
-    void init_ref_count() {
-#if REF_COUNT_GC
-        header.ref_count = 1;
-        log_ref_count(&header, header.ref_count);
-#else
-        header.ref_count = 0;
-#endif
-    }
-
-    void inc_ref_count() {
-#if REF_COUNT_GC
-        header.ref_count += 1;
-        log_ref_count(&header, header.ref_count);
-#endif
-    }
-
-    bool dec_ref_count() {
-#if REF_COUNT_GC
-        header.ref_count -= 1;
-        log_ref_count(&header, header.ref_count);
-        if (header.ref_count == 0) {
-            cleanup();
-            return true;
-        }
-        else {
-            return false;
-        }
-#else
-        return false;
-#endif
-    }
+    // These count only when the current heap's collector counts refs.
+    void init_ref_count();
+    void inc_ref_count();
+    bool dec_ref_count();
 
     void traverse(VisitFn f) const;
-    void fixup_references();
+    template <class Policy> void fixup_references(Heap &h);
+    void remember_refs(Heap &h);
+    bool has_ref_at(const Loc *slot) const;
     void cleanup();
     UWd size() const;
     SWd to_i() const;
@@ -134,47 +163,36 @@ class Obj {
 // happen because the C++ registers, stack and temporaries are not
 // treated as roots.
 
-// Refs never move because they are not allocated in Mem::heap,
+// Refs never move because they are not allocated in Heap::heap,
 // however, the loc value (which is a numeric offset from the start of
 // the heap) in a Ref may change at any time.
 
 class ObjRef {
   private:
-    friend class Mem;
+    friend class Heap;
 
     ObjRef &operator=(const ObjRef &rhs);
 
-    static ObjRef *root;
+    Heap *heap;
     ObjRef *prev;
     ObjRef *next;
 
-    void add_to_root_set() {
-        prev = 0;
-        if (root) {
-            root->prev = this;
-            next = root;
-        }
-        else {
-            next = 0;
-        }
-        root = this;
-    }
+    void add_to_root_set();
 
   protected:
-    enum RefType { ALLOC, COPY, SHARE };
+    enum RefType { ALLOC, COPY, SHARE, ADOPT };
     volatile Loc loc;
 
     ObjRef(RefType type, UWd loc_or_size, UWd new_size = 0);
 
   public:
-    static ObjRef *nil;
-
     ObjRef(const ObjRef &that);
 
     ~ObjRef();
 
     Loc share();
     static ObjRef at(Loc loc) { return ObjRef(ObjRef::SHARE, loc); }
+    static ObjRef adopt(Loc loc) { return ObjRef(ObjRef::ADOPT, loc); }
     static void unshare(Loc loc);
 
     Obj *referenced_Obj() const { return Obj::at(loc); }
@@ -201,103 +219,618 @@ class ForwardingAddress: public Obj {
     UWd to;
 };
 
+// Visualization info takes one 16-bit word per heap word, the same
+// size as the heap: the state in the low bits and above them a stamp
+// of the most recent access, which is all colors depend on. Stamps
+// are relative to an epoch that is moved up (saturating old stamps)
+// before they overflow.
+
 struct MemInfo {
-    static uint time;
+    enum State { Allocated = 1, Overhead = 2, Read = 4 };
+    static const int StateBits = 3;
+    static const uint StateMask = (1 << StateBits) - 1;
+    static const uint MaxStamp = 0xffff >> StateBits;
+    static const uint RecentStamps = 256;
+
+    uint time;
+    uint epoch;
+    int size;
+    std::vector<UWd> words; // stamp 0 means untouched since allocation
+
+    MemInfo(int _size) : time(0), epoch(0), size(_size), words(_size, 0) {}
+
+    int state(Loc loc) const { return words[loc] & StateMask; }
+    UWd stamp(Loc loc) const { return words[loc] >> StateBits; }
+
+    UWd now() const { return time - epoch; }
+
+    UWd tick() {
+        if (++time - epoch == MaxStamp) {
+            rebase();
+        }
+        return now();
+    }
+
+    void rebase() {
+        uint new_epoch = time - RecentStamps;
+        uint delta = new_epoch - epoch;
+        for (int loc = 0; loc < size; ++loc) {
+            uint s = words[loc] >> StateBits;
+            s = (s > delta) ? s - delta : (s != 0);
+            words[loc] = (s << StateBits) | (words[loc] & StateMask);
+        }
+        epoch = new_epoch;
+    }
+
+    void stamp_as(Loc loc, int state) {
+        UWd t = tick();
+        words[loc] = (t << StateBits) | state;
+    }
+
+    void was_allocated(Loc loc) { words[loc] = Allocated; }
+
+    void was_freed(Loc loc) { words[loc] &= ~Allocated; }
+
+    void was_read(Loc loc) { stamp_as(loc, state(loc) | Read); }
+
+    void was_written(Loc loc) { stamp_as(loc, state(loc) & Allocated); }
+
+    void was_overhead(Loc loc) { stamp_as(loc, (state(loc) & Allocated) | Overhead); }
+};
+
+// Snapshots are handed to a FrameSink as one color char per cell,
+// width cells per row, each cell drawn as a square of cell_size
+// pixels. The first WordPaletteSize colors are used by word
+// snapshots, the rest only by heat maps.
+
+struct PaletteColor {
+    char c;
+    const char *xpm;
+    int rgb;
+};
+
+const PaletteColor Palette[] = {
+    { ' ', "black", 0x000000 },
+    { '+', "#888888", 0x888888 },
+    { '#', "#ff0000", 0xff0000 },
+    { '0', "#00ff00", 0x00ff00 }, // 22ee22
+    { '1', "#22cc22", 0x22cc22 },
+    { '2', "#22aa22", 0x22aa22 },
+    { '3', "#228822", 0x228822 },
+    { 'a', "#ffff00", 0xffff00 }, // eeee22
+    { 'b', "#cccc22", 0xcccc22 },
+    { 'c', "#aaaa22", 0xaaaa22 },
+    { 'd', "#888822", 0x888822 },
+    { 'A', "#224488", 0x224488 },
+    { 'B', "#3366aa", 0x3366aa },
+    { 'C', "#4488cc", 0x4488cc },
+    { 'D', "#66aaff", 0x66aaff }
+};
+
+const int PaletteSize = sizeof(Palette) / sizeof(Palette[0]);
+const int WordPaletteSize = 11;
+
+// Fills n bytes with c. When SSE2 is available and n <= 16 this is
+// one broadcast store, so up to 16 bytes may be written and the
+// caller must leave room for the overrun.
+
+inline void fill_pixels(char *dst, char c, int n) {
+#if __SSE2__
+    if (n <= 16) {
+        _mm_storeu_si128((__m128i *)dst, _mm_set1_epi8(c));
+        return;
+    }
+#endif
+    memset(dst, c, n);
+}
+
+// Expands one row of cells into a row of pixels, mapping each cell
+// through lut.
+
+inline void expand_pixels(char *dst, const char *cells, int n, int cell_size,
+                          const unsigned char *lut) {
+    for (int x = 0; x < n; ++x) {
+        fill_pixels(dst + x * cell_size, lut[(unsigned char)cells[x]], cell_size);
+    }
+}
+
+class FrameSink {
+  public:
+    virtual ~FrameSink() {}
+    virtual void write(const char *cells, int count, int width, int cell_size, int colors) = 0;
+    virtual void close() {}
+
+    static FrameSink *open(std::string spec);
+};
+
+// One XPM file per frame, ready for ImageMagick convert.
+
+class XpmFrameSink: public FrameSink {
+  private:
+    long frame;
+    std::vector<char> pixels;
+    unsigned char identity[256];
+
+  public:
+    XpmFrameSink() : frame(0) {
+        for (int i = 0; i < 256; ++i) {
+            identity[i] = i;
+        }
+    }
+
+    // A row of XPM text is built once per row of cells: each cell is
+    // broadcast across its pixels and the finished row is copied
+    // down for the vertical repeats. The frame goes out in one write.
+
+    void write(const char *cells, int count, int width, int cell_size, int colors) {
+        std::ostringstream xpm_file_name;
+        xpm_file_name << "img" << std::setfill('0') << std::setw(8) << frame++ << ".xpm";
+
+        std::ofstream xpm_file;
+        xpm_file.open(xpm_file_name.str().c_str());
+
+        int rows = (count + width - 1) / width;
+        xpm_file << "/* XPM */\n"
+                 << "static char * plaid[] =\n"
+                 << "{\n"
+                 << "/* width height ncolors chars_per_pixel */\n"
+                 << "\"" << width * cell_size << " " << rows * cell_size << " " << colors << " 1\",\n"
+                 << "/* colors */\n";
+        for (int i = 0; i < colors; ++i) {
+            xpm_file << "\"" << Palette[i].c << " c " << Palette[i].xpm << "\",\n";
+        }
+        xpm_file << "/* pixels */\n";
+
+        int row_len = 1 + width * cell_size + 3;
+        pixels.resize(rows * cell_size * row_len + 16);
+
+        char *row = &pixels[0];
+        for (int first = 0; first < count; first += width) {
+            char *px = row + 1;
+            int n = (count - first < width) ? count - first : width;
+            row[0] = '"';
+            expand_pixels(px, cells + first, n, cell_size, identity);
+            memset(px + n * cell_size, ' ', (width - n) * cell_size);
+            memcpy(px + width * cell_size, "\",\n", 3);
+            for (int py = 1; py < cell_size; ++py) {
+                memcpy(row + py * row_len, row, row_len);
+            }
+            row += cell_size * row_len;
+        }
+        xpm_file.write(&pixels[0], row - &pixels[0]);
+
+        xpm_file << "};\n";
+        xpm_file.close();
+    }
+};
+
+// All frames in one file as palette indices, one byte per cell
+// (not expanded to pixels). The file is the header
+//
+//   "GCVZRAW1" width rows cell_size ncolors rgb[ncolors]
+//
+// followed by the frames and, when closed, an index of the frame
+// offsets, the frame count and the trailer "GCVZIDX1". Integers are
+// little-endian 32-bit, except the 64-bit offsets and count.
+
+class RawFrameSink: public FrameSink {
+  private:
+    std::ofstream file;
+    std::vector<unsigned long long> offsets;
+    unsigned char index_of[256];
 
-    bool is_allocated;
-    bool is_overhead;
-    uint last_write;
-    uint last_read;
+    void put32(unsigned long val) {
+        for (int i = 0; i < 4; ++i) {
+            file.put(char((val >> (8 * i)) & 0xff));
+        }
+    }
+
+    void put64(unsigned long long val) {
+        for (int i = 0; i < 8; ++i) {
+            file.put(char((val >> (8 * i)) & 0xff));
+        }
+    }
+
+  public:
+    RawFrameSink(const char *file_name) {
+        file.open(file_name, std::ios::out | std::ios::binary);
+        // anything not in the palette is drawn as Palette[0], unused
+        memset(index_of, 0, sizeof(index_of));
+        for (int i = 0; i < PaletteSize; ++i) {
+            index_of[(unsigned char)Palette[i].c] = i;
+        }
+    }
+
+    void write(const char *cells, int count, int width, int cell_size, int colors) {
+        int rows = (count + width - 1) / width;
+        if (offsets.empty()) {
+            file.write("GCVZRAW1", 8);
+            put32(width);
+            put32(rows);
+            put32(cell_size);
+            put32(colors);
+            for (int i = 0; i < colors; ++i) {
+                put32(Palette[i].rgb);
+            }
+        }
+        offsets.push_back(file.tellp());
+        std::vector<char> frame(width * rows, 0);
+        for (int i = 0; i < count; ++i) {
+            frame[i] = index_of[(unsigned char)cells[i]];
+        }
+        file.write(&frame[0], frame.size());
+    }
+
+    void close() {
+        if (!file.is_open()) {
+            return;
+        }
+        for (size_t i = 0; i < offsets.size(); ++i) {
+            put64(offsets[i]);
+        }
+        put64(offsets.size());
+        file.write("GCVZIDX1", 8);
+        file.close();
+    }
+};
+
+// A YUV4MPEG2 stream (4:4:4) that can be piped into a video encoder,
+// e.g. "--frames=y4m:/dev/stdout ... | ffmpeg -i - gc.mp4" when the
+// JavaScript trace is not needed.
+
+class Y4mFrameSink: public FrameSink {
+  private:
+    std::ofstream file;
+    bool started;
+    unsigned char plane_lut[3][256];
+    std::vector<char> plane;
+
+  public:
+    Y4mFrameSink(const char *file_name) : started(false) {
+        file.open(file_name, std::ios::out | std::ios::binary);
+        // anything not in the palette is drawn black
+        memset(plane_lut[0], 16, sizeof(plane_lut[0]));
+        memset(plane_lut[1], 128, sizeof(plane_lut[1]));
+        memset(plane_lut[2], 128, sizeof(plane_lut[2]));
+        for (int i = 0; i < PaletteSize; ++i) {
+            int r = (Palette[i].rgb >> 16) & 0xff;
+            int g = (Palette[i].rgb >> 8) & 0xff;
+            int b = Palette[i].rgb & 0xff;
+            unsigned char c = Palette[i].c;
+            plane_lut[0][c] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+            plane_lut[1][c] = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+            plane_lut[2][c] = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+        }
+    }
+
+    void write(const char *cells, int count, int width, int cell_size, int) {
+        int rows = (count + width - 1) / width;
+        int image_width = width * cell_size;
+        if (!started) {
+            file << "YUV4MPEG2 W" << image_width << " H" << rows * cell_size
+                 << " F30:1 Ip A1:1 C444\n";
+            started = true;
+        }
+        file << "FRAME\n";
+        plane.resize(rows * cell_size * image_width + 16);
+        for (int p = 0; p < 3; ++p) {
+            char *row = &plane[0];
+            for (int first = 0; first < count; first += width) {
+                int n = (count - first < width) ? count - first : width;
+                expand_pixels(row, cells + first, n, cell_size, plane_lut[p]);
+                memset(row + n * cell_size, plane_lut[p][' '], (width - n) * cell_size);
+                for (int py = 1; py < cell_size; ++py) {
+                    memcpy(row + py * image_width, row, image_width);
+                }
+                row += cell_size * image_width;
+            }
+            file.write(&plane[0], row - &plane[0]);
+        }
+    }
 
-    MemInfo() {
-        is_allocated = false;
-        is_overhead = false;
-        last_read = 0;
-        last_write = 0;
+    void close() {
+        file.close();
     }
+};
+
+// spec is "xpm", "raw:FILE" or "y4m:FILE". Returns 0 for anything
+// else.
 
-    void was_allocated() {
-        is_allocated = true;
-        is_overhead = false;
-        last_read = 0;
-        last_write = 0;
+FrameSink *FrameSink::open(std::string spec) {
+    if (spec.compare(0, 4, "raw:") == 0) {
+        return new RawFrameSink(spec.c_str() + 4);
     }
+    else if (spec.compare(0, 4, "y4m:") == 0) {
+        return new Y4mFrameSink(spec.c_str() + 4);
+    }
+    else if (spec == "xpm") {
+        return new XpmFrameSink();
+    }
+    return 0;
+}
 
-    void was_freed() { is_allocated = false; }
-    void was_read() { last_read = ++time; }
-    void was_written() { last_write = ++time; is_overhead = false; }
-    void was_overhead() { last_write = ++time; is_overhead = true; }
+// Pluggable GC algorithms are policies: structs of static hooks
+// and flags. CollectorFor<Policy> instantiates the collection loops
+// for each policy so the per-object hooks are inlined, and the
+// Collector interface lets one binary pick an algorithm at run time.
+
+class Collector {
+  public:
+    virtual ~Collector() {}
+    virtual const char *name() const = 0;
+    virtual bool counts_refs() const = 0;
+    virtual bool brooks_words() const = 0;
+    virtual bool starts_cycles() const = 0;
+    virtual bool resizes() const = 0;
+    virtual Loc alloc_limit(Heap &h) = 0;
+    virtual Loc min_size(Heap &h) = 0;
+    virtual long unused_words(Heap &h) = 0;
+    virtual bool bump_in_hole(Heap &h, UWd n, Loc &loc) = 0;
+    virtual Loc read_barrier(Heap &h, Loc loc) = 0;
+    virtual void remember(Heap &h, Loc *slot) = 0;
+    virtual void step(Heap &h, UWd n) = 0;
+    virtual bool start_cycle(Heap &h) = 0;
+    virtual void gc(Heap &h) = 0;
+
+    static Collector *named(std::string name);
 };
 
-class Mem {
+// A Heap holds everything about one managed heap: the words
+// themselves, the root set, the collector and the visualization
+// state. Several heaps can live side by side in one process. Each
+// thread works on Heap::current; ObjRefs are bound to the heap that
+// was current when they were made and must only be used while that
+// heap is current.
+
+class Heap {
   public:
+    static thread_local Heap *current;
+
     // Real GC algorithms use unused heap space for marking the live
     // sets and storing forwarding addresses for moved objects.
-    static std::map<Loc, Loc> forwarding;
-    static std::set<Loc> live;
-    static UWd heap[HeapSize];
-    static MemInfo info[HeapSize]; // visualization info
-    static Loc top;
-    static Loc from_space;
-    static Loc to_space;
-
-    static Loc addr_to_loc(const void *addr) {
+    std::map<Loc, Loc> forwarding;
+    std::vector<int> image_ref_counts; // while saving an image
+    std::set<Loc> live;
+    std::map<Loc, UWd> free_blocks; // coalesced, by address
+    bool collecting; // an incremental collector has work to do
+    bool reads_checked; // refs read go through the collector's read barrier
+    bool stores_remembered; // ref stores go through its write barrier
+    bool out_of_room; // the running cycle can't go on in this heap
+    UWd *heap;
+    Loc size;
+    Loc capacity; // words allocated, which heap sizing can grow into
+    Loc semi_size;
+    MemInfo info; // visualization info
+    Loc top;
+    Loc copy_source; // rooted while copy() reserves space
+    ObjRef *root;
+    ObjRef *nil;
+    Collector *collector;
+    bool ref_counting; // cached from the collector for Obj
+    bool brooks; // every object has a Brooks word in front of it
+    bool logging;
+    bool in_gc;
+
+    // GC statistics for benchmarks
+    long gc_count;
+    double gc_seconds;
+    double max_pause_seconds;
+    std::chrono::steady_clock::time_point born;
+    struct Pause { double start, end; }; // seconds since born
+    bool keep_pauses;
+    std::vector<Pause> pauses; // every pause, for the MMU curve
+
+    // With a utilization goal, incremental work runs in time quanta
+    // scheduled by the clock instead of a few words per allocation.
+    double mmu_goal; // fraction of every window left to the program
+    double mmu_window; // seconds
+    std::deque<Pause> window_pauses;
+    double window_gc_seconds;
+    long step_debt; // words allocated in this cycle no step paid for
+    bool mmu_missed; // warned that the goal wasn't met
+
+    UWd max_alloc_since_gc; // allocation demand, for HYBRID_GC
+    long allocated_since_gc;
+    long release_keep; // free words kept resident
+    bool semispaces; // ADAPTIVE_GC copies this cycle, else compacts
+
+    // With a pause or overhead goal, the heap is resized after every
+    // collection, between heap_min and heap_max.
+    double pause_goal; // seconds
+    double overhead_goal; // fraction of the run spent collecting
+    Loc heap_min;
+    Loc heap_max;
+    double gc_overhead; // smoothed over recent collections
+    double last_gc_end; // seconds since born
+    bool measure_live;
+    int max_live_words;
+    int allocs_until_sample;
+
+    Heap(Collector *c, int _size = HeapSize, int _capacity = 0);
+    ~Heap();
+
+    Loc addr_to_loc(const void *addr) {
         Loc loc = ((char *)(addr) - (char *)heap) / sizeof(UWd);
-        assert(loc < HeapSize);
+        assert(loc < size);
         return loc;
     }
 
-    // TODO: implement a first-fit algorithm instead of just the bump allocator.
-    // free must add memory back to allocator, blocks should be coalesced
+    // Allocation bumps top until it reaches the collector's limit.
+    // After that, blocks freed by sweeping or ref counting are reused
+    // first fit, or Immix bumps through the free lines it found, and
+    // when that fails too the heap collects and tries again.
 
-    static Loc reserve(UWd size) {
-        Loc loc = top;
-        top += size;
-        assert(top < HeapSize);
-        log_alloc_mem(loc, size);
+    Loc reserve(UWd n) {
+        if (measure_live && !in_gc && --allocs_until_sample <= 0) {
+            sample_live();
+        }
+        max_alloc_since_gc = std::max(max_alloc_since_gc, n);
+        if (!in_gc) {
+            allocated_since_gc += n;
+        }
+        if (mmu_goal > 0 && !in_gc) {
+            gc_quantum();
+        }
+        if (collecting && !in_gc) {
+            // under --mmu the clock's quanta come first, and the
+            // allocation-paced steps only start when they fall behind
+            step_debt += n;
+            if (mmu_goal == 0 || step_debt > size / MetronomeSlackFraction) {
+                gc_step(n);
+            }
+        }
+        if (out_of_room && !in_gc) {
+            exhausted(n);
+        }
+        Loc loc = find_space(n);
+        log_alloc_mem(loc, n);
         return loc;
     }
 
-    static Loc reserve_with_possible_overlap(UWd size) {
+    Loc find_space(UWd n) {
+        Loc loc;
+        if (bump(n, loc) || first_fit(n, loc) || collector->bump_in_hole(*this, n, loc)) {
+            return loc;
+        }
+        if (!in_gc && mmu_goal > 0 && !collecting) {
+            // starting a cycle out of turn still beats stopping the
+            // program, and frees what the last one found dead
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            in_gc = true;
+            bool started = collector->start_cycle(*this);
+            in_gc = false;
+            if (started) {
+                gc_count += 1;
+                step_debt = 0;
+                count_pause(start);
+                if (bump(n, loc) || first_fit(n, loc) || collector->bump_in_hole(*this, n, loc)) {
+                    return loc;
+                }
+            }
+        }
+        if (!in_gc) {
+            if (mmu_goal > 0) {
+                missed_mmu("the heap ran out, so it collected with the program stopped");
+            }
+            gc();
+            if (out_of_room) {
+                exhausted(n);
+            }
+            if (bump(n, loc) || first_fit(n, loc) || collector->bump_in_hole(*this, n, loc)) {
+                return loc;
+            }
+            // heap sizing grows the heap rather than run out, which
+            // takes one more flip if the semispaces' live data is in
+            // the upper half, the only time min_size is 0 here
+            if (size < heap_max) {
+                if (!resize_to(2L * size) && collector->min_size(*this) == 0) {
+                    gc();
+                    resize_to(2L * size);
+                }
+                if (bump(n, loc) || first_fit(n, loc) || collector->bump_in_hole(*this, n, loc)) {
+                    return loc;
+                }
+            }
+        }
+        exhausted(n);
+        return 0;
+    }
+
+    void exhausted(UWd n) {
+        if (out_of_room) {
+            std::cerr << collector->name() << " ran out of room before its cycle finished\n";
+        }
+        std::cerr << "heap exhausted allocating " << n << " words\n";
+        exit(ExitHeapExhausted);
+    }
+
+    bool bump(UWd n, Loc &loc);
+
+    bool first_fit(UWd n, Loc &loc) {
+        std::map<Loc, UWd>::iterator it;
+        for (it = free_blocks.begin(); it != free_blocks.end(); ++it) {
+            if (it->second >= n) {
+                loc = it->first;
+                UWd rest = it->second - n;
+                free_blocks.erase(it);
+                if (rest >= 2) {
+                    FreeBlock *b = (FreeBlock *)(heap + loc + n);
+                    b->header.type = Obj::TFree;
+                    b->len = rest;
+                    free_blocks[loc + n] = rest;
+                }
+                else if (rest == 1) {
+                    heap[loc + n] = 0; // a nil filler word, never freed
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Loc reserve_with_possible_overlap(UWd n) {
         Loc loc = top;
-        top += size;
-        assert(top < HeapSize);
+        top += n;
+        assert(top < size);
         return loc;
     }
 
-    static Loc alloc(UWd size) {
-        Loc loc = reserve(size);
-        for (int i = 0; i < size; ++i) {
+    // Under BROOKS_GC every object is preceded by a word that holds
+    // where the object is now, which starts out as itself. Obj::at
+    // goes through it, so a ref to an old copy still works.
+
+    Loc reserve_object(UWd n) {
+        if (!brooks) {
+            return reserve(n);
+        }
+        Loc loc = reserve(n + 1) + 1;
+        heap[loc - 1] = loc;
+        return loc;
+    }
+
+    Loc follow(Loc loc) {
+        if (brooks && loc) {
+            return heap[loc - 1];
+        }
+        return loc_after_forwarding_address(loc);
+    }
+
+    Loc alloc(UWd n) {
+        assert(n >= 2);
+        Loc loc = reserve_object(n);
+        for (int i = 0; i < n; ++i) {
             heap[loc + i] = 0;
         }
+        // Until init() gives it a type, the new object looks like a
+        // free block of the right size to any collection triggered by
+        // the next allocation.
+        FreeBlock *b = (FreeBlock *)(heap + loc);
+        b->header.type = Obj::TFree;
+        b->len = n;
         return loc;
     }
 
-    static Loc copy(Loc from, UWd new_size = 0) {
-        UWd size = Obj::at(from)->size();
-        if (new_size > 0) {
-            Loc to = reserve(new_size);
-            UWd min = (new_size < size) ? new_size : size;
-            for (int i = 0; i < min; ++i) {
-                heap[to + i] = heap[from + i];
-            }
-            for (int i = min; i < new_size; ++i) {
-                heap[to + i] = 0;
-            }
-            log_copy_mem(to, from, min);
-            return to;
+    Loc copy(Loc from, UWd new_size = 0) {
+        UWd old_size = Obj::at(from)->size();
+        if (new_size == 0) {
+            new_size = old_size;
         }
-        else {
-            Loc to = reserve(size);
-            for (int i = 0; i < size; ++i) {
-                heap[to + i] = heap[from + i];
-            }
-            log_copy_mem(to, from, size);
-            return to;
+        copy_source = from;
+        Loc to = reserve_object(new_size);
+        from = follow(copy_source);
+        copy_source = 0;
+        UWd min = (new_size < old_size) ? new_size : old_size;
+        for (int i = 0; i < min; ++i) {
+            heap[to + i] = heap[from + i];
+        }
+        for (int i = min; i < new_size; ++i) {
+            heap[to + i] = 0;
         }
+        log_copy_mem(to, from, min);
+        return to;
     }
 
-    static Loc move_without_forwarding(Loc from, UWd size) {
+    Loc move_without_forwarding(Loc from, UWd size) {
         Obj *from_obj = Obj::at(from);
         Loc to = reserve_with_possible_overlap(size);
         for (int i = 0; i < size; ++i) {
@@ -307,7 +840,7 @@ class Mem {
         return to;
     }
 
-    static Loc move(Loc from) {
+    Loc move(Loc from) {
         Obj *from_obj = Obj::at(from);
         UWd size = from_obj->size();
         Loc to = reserve(size);
@@ -321,53 +854,150 @@ class Mem {
         return to;
     }
 
-    static Loc read_barrier(Loc loc) {
+    // Collectors that need to see every ref the program reads set
+    // reads_checked and get them through their read_barrier hook.
+
+    Loc read_barrier(Loc loc) {
+        if (reads_checked) {
+            return collector->read_barrier(*this, loc);
+        }
         return loc;
     }
 
-    static void free(Loc loc, int size) {
+    // The write barrier: every store of a ref into the heap calls it,
+    // and collectors that set stores_remembered get the slot.
+    void remember(Loc *slot) {
+        if (stores_remembered) {
+            collector->remember(*this, slot);
+        }
+    }
+
+    void free(Loc loc, int n) {
+        // take along a one word filler left behind by first_fit so
+        // that the fillers don't pin fragments forever
+        if (loc + n < top && heap[loc + n] == 0) {
+            n += 1;
+        }
         FreeBlock *b = (FreeBlock *)Obj::at(loc);
         b->init(Obj::TFree);
-        b->len = size;
-        log_free_mem(loc, size);
+        b->len = n;
+        log_free_mem(loc, n);
+        add_free_block(loc, n);
+    }
+
+    // Sweeping frees blocks that are already free, so adding a block
+    // that is already covered does nothing. Neighbours are coalesced
+    // in the map only; their headers stay as they are.
+
+    void add_free_block(Loc loc, UWd n) {
+        std::map<Loc, UWd>::iterator next = free_blocks.upper_bound(loc);
+        if (next != free_blocks.begin()) {
+            std::map<Loc, UWd>::iterator prev = next;
+            --prev;
+            if (prev->first + prev->second > loc) {
+                return;
+            }
+            if (prev->first + prev->second == loc) {
+                loc = prev->first;
+                n += prev->second;
+                free_blocks.erase(prev);
+            }
+        }
+        if (next != free_blocks.end() && loc + n == next->first) {
+            n += next->second;
+            free_blocks.erase(next);
+        }
+        free_blocks[loc] = n;
+    }
+
+    // Gives the whole pages in [begin, end) back to the OS. They read
+    // as zeros when next touched, so nothing that is walked or read
+    // may be left there. Returns false if there was no whole page.
+
+    bool release_words(long begin, long end) {
+        static const uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t b = ((uintptr_t)(heap + begin) + page - 1) & ~(page - 1);
+        uintptr_t e = (uintptr_t)(heap + end) & ~(page - 1);
+        if (begin >= end || b >= e) {
+            return false;
+        }
+        madvise((void *)b, e - b, MADV_DONTNEED);
+        return true;
+    }
+
+    // After sweeping or compacting: the free blocks past the first
+    // release_keep free words, then the words above top. A block that
+    // loses pages gets one header spanning it, as the headers of the
+    // neighbours it was coalesced with may be gone.
+
+    void release_free_space() {
+        long keep = release_keep;
+        std::map<Loc, UWd>::iterator it;
+        for (it = free_blocks.begin(); it != free_blocks.end(); ++it) {
+            Loc loc = it->first;
+            UWd n = it->second;
+            if (keep >= n) {
+                keep -= n;
+                continue;
+            }
+            if (release_words(loc + std::max(keep, 2L), loc + n)) {
+                FreeBlock *b = (FreeBlock *)(heap + loc);
+                heap[loc] = 0;
+                b->header.type = Obj::TFree;
+                b->len = n;
+            }
+            keep = 0;
+        }
+        release_words(top + keep, capacity);
     }
 
+    // Visitors for Obj::traverse, which only passes a loc, so they
+    // work on the current heap.
+
+    template <class Policy>
     static void mark_live_loc(Loc loc) {
         if (loc != 0) {
-#if !COPY_GC
-            log_ref_count(loc, 1); // treat marking as ref count for visualization
-#endif
-            live.insert(loc);
+            if (Policy::logs_marks) {
+                log_ref_count(loc, 1); // treat marking as ref count for visualization
+            }
+            current->live.insert(loc);
         }
     }
 
-    static void mark_live() {
-        ObjRef *p = ObjRef::root;
+    template <class Policy>
+    void mark_live() {
+        ObjRef *p = root;
         live.clear();
         while (p) {
             Loc loc = p->loc;
-            mark_live_loc(loc);
-            Obj::at(loc)->traverse(mark_live_loc);
+            mark_live_loc<Policy>(loc);
+            Obj::at(loc)->traverse(mark_live_loc<Policy>);
             p = p->next;
         }
+        if (copy_source) {
+            mark_live_loc<Policy>(copy_source);
+            Obj::at(copy_source)->traverse(mark_live_loc<Policy>);
+        }
     }
 
-    static void sweep_garbage() {
+    void sweep_garbage() {
         Loc loc = 1;
         while (loc < top) {
             Obj *obj = Obj::at(loc);
             int size = obj->size();
-            if (live.count(loc) == 0) {
+            if (live.count(loc) == 0 && obj->type() != Obj::TNil) {
                 free(loc, size);
             }
             loc += size;
         }
     }
 
-    static void move_live() {
-        mark_live();
+    template <class Policy>
+    void move_live() {
+        mark_live<Policy>();
+        free_blocks.clear();
         // nil is located at heap loc 0 and doesn't move
-        top = (top >= HeapSemiSize) ? 1 : HeapSemiSize;
+        top = (top >= semi_size) ? 1 : semi_size;
         std::set<Loc>::iterator it;
         for (it = live.begin(); it != live.end(); ++it) {
             Loc from = *it;
@@ -377,9 +1007,17 @@ class Mem {
         }
     }
 
-    static void compact_live() {
+    template <class Policy>
+    void compact_live() {
+        mark_live<Policy>();
+        slide_live();
+    }
+
+    // Slides the objects marked live down over the rest, in order.
+
+    void slide_live() {
         forwarding.clear();
-        mark_live();
+        free_blocks.clear();
         Loc old_top = top;
         Loc from = 1;
         while (from < old_top) {
@@ -398,290 +1036,2066 @@ class Mem {
         }
     }
 
-    static Loc loc_after_move(Loc loc) {
-#if COPY_GC
+    Loc loc_after_forwarding_address(Loc loc) {
         ForwardingAddress *b = (ForwardingAddress *)Obj::at(loc);
         return (b->type() == Obj::TForward) ? b->to : loc;
-#else
+    }
+
+    Loc loc_after_forwarding_map(Loc loc) {
         std::map<Loc,Loc>::iterator it = forwarding.find(loc);
         return (it != forwarding.end()) ? it->second : loc;
-#endif
     }
 
-    static void fixup_references() {
-        ObjRef *p = ObjRef::root;
+    template <class Policy>
+    void fixup_roots() {
+        ObjRef *p = root;
         while (p) {
-            p->loc = loc_after_move(p->loc);
+            p->loc = Policy::loc_after_move(*this, p->loc);
             p = p->next;
         }
-#if COPY_GC
-        Loc loc = (top >= HeapSemiSize) ? HeapSemiSize : 1;
-#else
-        Loc loc = 1;
-#endif
+        if (copy_source) {
+            copy_source = Policy::loc_after_move(*this, copy_source);
+        }
+    }
+
+    template <class Policy>
+    void fixup_references() {
+        fixup_roots<Policy>();
+        Loc loc = Policy::first_loc(*this);
         while (loc < top) {
             Obj *obj = Obj::at(loc);
             int size = obj->size();
-            obj->fixup_references();
+            obj->fixup_references<Policy>(*this);
             loc += size;
         }
     }
 
-    static void gc() {
-#if MARK_SWEEP_GC
-        mark_live();
-        sweep_garbage();
-#else
-#if COPY_GC
-        move_live();
-        fixup_references();
-        if (top >= HeapSemiSize) {
-            log_free_mem(1, HeapSemiSize - 1);
-        }
-        else {
-            log_free_mem(HeapSemiSize, HeapSemiSize);
-        }
-#else
-#if MARK_COMPACT_GC
-        Loc old_top = top;
-        compact_live();
-        if (old_top > top) {
-            fixup_references();
-            log_free_mem(top, old_top - top);
+    void gc() {
+        assert(this == current);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        release_keep = std::max(allocated_since_gc, release_keep * ReleaseKeepDecayPercent / 100);
+        allocated_since_gc = 0;
+        in_gc = true;
+        collector->gc(*this);
+        in_gc = false;
+        gc_count += 1;
+        max_alloc_since_gc = 0;
+        count_pause(start);
+        if (pause_goal > 0 || overhead_goal > 0) {
+            size_for_goals(start);
+        }
+        if (measure_live) {
+            sample_live();
+        }
+    }
+
+    // The pause goal comes first: a longer pause shrinks the heap,
+    // which bounds how much a collection can find to mark, sweep or
+    // move. Otherwise the share of the time since the last collection
+    // that this one took, smoothed, is held near overhead_goal. The
+    // heap grows by the factor it's over, as collections then come
+    // about that much less often, and shrinks a little when GC took
+    // under half its share, so the heap follows the program back down.
+
+    void size_for_goals(std::chrono::steady_clock::time_point start) {
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        double pause = std::chrono::duration<double>(end - start).count();
+        double now = std::chrono::duration<double>(end - born).count();
+        double overhead = (now > last_gc_end) ? pause / (now - last_gc_end) : 1;
+        if (gc_count == 1) {
+            gc_overhead = overhead;
+        }
+        else {
+            gc_overhead += (overhead - gc_overhead) * SizingSmoothingPercent / 100;
+        }
+        last_gc_end = now;
+
+        int percent = 100;
+        if (pause_goal > 0 && pause > pause_goal) {
+            percent = SizingPauseShrinkPercent;
+        }
+        else if (overhead_goal > 0 && gc_overhead > overhead_goal) {
+            percent = std::min(gc_overhead / overhead_goal * 100, (double)SizingMaxGrowthPercent);
+        }
+        else if (overhead_goal > 0 && gc_overhead < overhead_goal / 2) {
+            percent = SizingIdleShrinkPercent;
+        }
+        resize_to((long)size * percent / 100);
+    }
+
+    // Moves the end of the heap as close to want as the bounds and
+    // the collector allow. The words up to capacity are there from
+    // the start, so nothing moves. Returns false if size didn't change.
+
+    bool resize_to(long want) {
+        long least = collector->min_size(*this);
+        if (least == 0) {
+            return false;
+        }
+        least = std::max(least, (long)heap_min);
+        want = std::max(std::min(want, (long)heap_max), least);
+        if (want == size || want > heap_max) {
+            return false;
+        }
+        release_words(want, size);
+        size = want;
+        semi_size = size / 2;
+        return true;
+    }
+
+    // Incremental collectors do a bounded amount of work before each
+    // allocation. Each step counts as a pause of its own.
+
+    void gc_step(UWd n) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        in_gc = true;
+        collector->step(*this, n);
+        in_gc = false;
+        step_debt = std::max(0L, step_debt - n);
+        count_pause(start);
+    }
+
+    void count_pause(std::chrono::steady_clock::time_point start) {
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        std::chrono::duration<double> pause = end - start;
+        gc_seconds += pause.count();
+        if (pause.count() > max_pause_seconds) {
+            max_pause_seconds = pause.count();
+        }
+        if (keep_pauses || mmu_goal > 0) {
+            Pause p;
+            p.start = std::chrono::duration<double>(start - born).count();
+            p.end = std::chrono::duration<double>(end - born).count();
+            if (keep_pauses) {
+                pauses.push_back(p);
+            }
+            if (mmu_goal > 0) {
+                window_pauses.push_back(p);
+                window_gc_seconds += pause.count();
+                drop_old_pauses(p.end);
+                double over = window_gc_seconds - (1 - mmu_goal) * mmu_window;
+                if (over > mmu_window / MetronomeQuantaPerWindow) {
+                    missed_mmu("a window spent more than a quantum over its share collecting");
+                }
+            }
+        }
+    }
+
+    void drop_old_pauses(double now) {
+        while (!window_pauses.empty() && window_pauses.front().end <= now - mmu_window) {
+            window_gc_seconds -= window_pauses.front().end - window_pauses.front().start;
+            window_pauses.pop_front();
+        }
+    }
+
+    // The goal can't always be met: the heap may be too small for what
+    // the program allocates while a cycle runs at the clock's pace.
+    // The run carries on, but says so once.
+
+    void missed_mmu(const char *why) {
+        if (!mmu_missed) {
+            mmu_missed = true;
+            std::cerr << "warning: " << collector->name() << " missed --mmu=" << mmu_goal * 100
+                      << "/" << mmu_window * 1000 << ": " << why << "\n";
+        }
+    }
+
+    // Metronome's scheduler: the mutator polls at every allocation,
+    // and if the last mmu_window has room for another quantum of GC
+    // time without going under mmu_goal, the collector gets one. A
+    // quantum runs small steps until its time is up or the cycle is
+    // done, and starts a new cycle if none is running and the free
+    // space is down to the reserve. Only collectors whose cycles run
+    // in steps take --mmu, see starts_cycles.
+
+    void gc_quantum() {
+        bool working = collecting;
+        if (!working && collector->unused_words(*this) >= size / MetronomeReserveFraction) {
+            return;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        drop_old_pauses(std::chrono::duration<double>(start - born).count());
+        double allowed = (1 - mmu_goal) * mmu_window;
+        double quantum = std::min(mmu_window / MetronomeQuantaPerWindow, allowed);
+        if (window_gc_seconds + quantum > allowed) {
+            return;
+        }
+        in_gc = true;
+        if (!working) {
+            if (!collector->start_cycle(*this)) {
+                in_gc = false;
+                return;
+            }
+            gc_count += 1;
+            step_debt = 0;
+        }
+        while (collecting &&
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < quantum) {
+            collector->step(*this, MetronomeStepWords);
+            step_debt = std::max(0L, step_debt - MetronomeStepWords);
+        }
+        in_gc = false;
+        count_pause(start);
+    }
+
+    // --measure-live samples the live size after every collection and
+    // every so many allocations, which is close enough to size heaps.
+
+    void sample_live() {
+        int words = live_words();
+        if (words > max_live_words) {
+            max_live_words = words;
+        }
+        allocs_until_sample = LiveSampleInterval;
+    }
+
+    // Words reachable from the roots, found the same way as log_roots.
+
+    int live_words() {
+        live.clear();
+        for (ObjRef *p = root; p; p = p->next) {
+            Loc loc = follow(p->loc);
+            live.insert(loc);
+            Obj::at(loc)->traverse(add_live_loc);
+        }
+        int words = 0;
+        std::set<Loc>::iterator it;
+        for (it = live.begin(); it != live.end(); ++it) {
+            words += Obj::at(*it)->size();
+        }
+        return words;
+    }
+
+    static void add_live_loc(Loc loc) {
+        current->live.insert(loc);
+    }
+
+    void log_roots(std::string msg);
+
+    void save_image(const char *file_name);
+    bool load_image(const char *file_name, std::vector<Loc> &roots);
+    bool load_object_by_object(const UWd *image, int image_top, std::vector<Loc> &roots);
+
+    static char color_of_stamp(UWd now, UWd stamp, int state) {
+        UWd age = now - stamp;
+        int bucket = (age >= 5) + (age >= 25) + (age >= 125);
+        char c = ((state & MemInfo::Read) ? '0' : 'a') + bucket;
+        c = ((state & MemInfo::Overhead) && bucket == 0) ? '#' : c;
+        c = (stamp == 0) ? '+' : c;
+        return (state & MemInfo::Allocated) ? c : ' ';
+    }
+
+    // Colors for a run of words.
+
+    void colors_of_mem(char *colors, Loc begin, Loc end) {
+        UWd now = info.now();
+        for (int loc = begin; loc < end; ++loc) {
+            colors[loc - begin] = color_of_stamp(now, info.stamp(loc), info.state(loc));
+        }
+    }
+
+    // Heat map cells aggregate a block of words.
+
+    enum SnapMode { SnapWords, SnapRecency, SnapOccupancy, SnapState };
+    SnapMode snap_mode;
+
+    char recency_of_block(Loc begin, Loc end) {
+        // the newest access to an allocated word wins, and the stamp
+        // is in the high bits
+        UWd newest = 0;
+        for (int loc = begin; loc < end; ++loc) {
+            UWd key = info.words[loc];
+            key = (key & MemInfo::Allocated) ? key : 0;
+            newest = (key > newest) ? key : newest;
+        }
+        return color_of_stamp(info.now(), newest >> MemInfo::StateBits, newest & MemInfo::StateMask);
+    }
+
+    char occupancy_of_block(Loc begin, Loc end) {
+        int allocated = 0;
+        for (int loc = begin; loc < end; ++loc) {
+            allocated += info.words[loc] & MemInfo::Allocated;
+        }
+        if (allocated == 0) { return ' '; }
+        return "ABCD"[(allocated * 4 - 1) / (end - begin)];
+    }
+
+    // The most common color_of_stamp in the block. A word's color is
+    // looked up by its state bits and its age bucket, with bucket 4
+    // for untouched words, as an index into states.
+
+    char state_of_block(Loc begin, Loc end) {
+        static const char states[] = " +#0123abcd";
+        static const unsigned char index_of[8][5] = {
+            { 0, 0, 0, 0, 0 },
+            { 7, 8, 9, 10, 1 }, // Allocated
+            { 0, 0, 0, 0, 0 },
+            { 2, 8, 9, 10, 1 }, // Allocated | Overhead
+            { 0, 0, 0, 0, 0 },
+            { 3, 4, 5, 6, 1 }, // Allocated | Read
+            { 0, 0, 0, 0, 0 },
+            { 2, 4, 5, 6, 1 } // Allocated | Overhead | Read
+        };
+        int count[sizeof(states) - 1] = { 0 };
+        UWd now = info.now();
+        for (int loc = begin; loc < end; ++loc) {
+            UWd stamp = info.stamp(loc);
+            UWd age = now - stamp;
+            int bucket = (age >= 5) + (age >= 25) + (age >= 125);
+            bucket = (stamp == 0) ? 4 : bucket;
+            count[index_of[info.state(loc)][bucket]] += 1;
+        }
+        return states[std::max_element(count, count + sizeof(states) - 1) - count];
+    }
+
+    int heat_map_words_per_cell() const {
+        int cells = HeatMapWidth * HeatMapHeight;
+        return (capacity + cells - 1) / cells;
+    }
+
+    char color_of_heat_cell(int cell) {
+        int words = heat_map_words_per_cell();
+        Loc begin = cell * words;
+        int end = begin + words;
+        if (end > capacity) {
+            end = capacity;
+        }
+        switch (snap_mode) {
+            case SnapRecency:
+                return recency_of_block(begin, end);
+            case SnapOccupancy:
+                return occupancy_of_block(begin, end);
+            default:
+                return state_of_block(begin, end);
+        }
+    }
+
+    FrameSink *frame_sink;
+
+    std::vector<char> cells;
+
+    // Snapshots cover capacity so that every frame of a run is the
+    // same size while heap sizing moves the end of the heap.
+
+    void snap() {
+        cells.resize(capacity);
+        if (snap_mode != SnapWords) {
+            int words = heat_map_words_per_cell();
+            int count = (capacity + words - 1) / words;
+            for (int cell = 0; cell < count; ++cell) {
+                cells[cell] = color_of_heat_cell(cell);
+            }
+            frame_sink->write(&cells[0], count, HeatMapWidth, HeatMapCellSize, PaletteSize);
+        }
+        else {
+            colors_of_mem(&cells[0], 0, capacity);
+            frame_sink->write(&cells[0], capacity, ImageWidthInWords, ImageWordSize, WordPaletteSize);
+        }
+    }
+};
+
+thread_local Heap *Heap::current = 0;
+
+// A collector keeps what only it needs in its policy's State, which
+// CollectorFor<Policy> owns, so a heap doesn't carry every
+// collector's fields. state_of<Policy>(h) finds it, and h's collector
+// has to be a CollectorFor<Policy>.
+
+template <class Policy> typename Policy::State &state_of(Heap &h);
+
+// Free at exit: the heap just grows.
+
+struct NoGC {
+    struct State {};
+
+    static const char *name() { return "NO_GC"; }
+    static const bool counts_refs = false;
+    static const bool brooks_words = false;
+    static const bool starts_cycles = false; // incremental ones, for --mmu
+    static const bool resizes = true; // for heap sizing
+    static const bool logs_marks = true;
+    static Loc first_loc(Heap &) { return 1; }
+    static Loc alloc_limit(Heap &h) { return h.size; }
+    static Loc min_size(Heap &h) { return h.top + 1; } // 0 if not now
+    static long unused_words(Heap &h) { return h.size - h.top; } // roughly
+    static bool bump_in_hole(Heap &, UWd, Loc &) { return false; }
+    static Loc read_barrier(Heap &, Loc loc) { return loc; }
+    static void remember(Heap &, Loc *) {}
+    static void step(Heap &, UWd) {}
+    static bool start_cycle(Heap &) { return false; }
+    static Loc loc_after_move(Heap &, Loc loc) { return loc; }
+    static void gc(Heap &) {}
+};
+
+// Objects are freed by ObjRef and Tup/Vec cleanup when their count
+// drops to zero, so there is nothing left for gc() to do.
+
+struct RefCountGC: public NoGC {
+    static const char *name() { return "REF_COUNT_GC"; }
+    static const bool counts_refs = true;
+};
+
+struct MarkSweepGC: public NoGC {
+    static const char *name() { return "MARK_SWEEP_GC"; }
+
+    static void gc(Heap &h) {
+        h.mark_live<MarkSweepGC>();
+        h.sweep_garbage();
+        h.release_free_space();
+    }
+};
+
+struct MarkCompactGC: public NoGC {
+    static const char *name() { return "MARK_COMPACT_GC"; }
+
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        return h.loc_after_forwarding_map(loc);
+    }
+
+    static void gc(Heap &h) {
+        Loc old_top = h.top;
+        h.compact_live<MarkCompactGC>();
+        if (old_top > h.top) {
+            h.fixup_references<MarkCompactGC>();
+            log_free_mem(h.top, old_top - h.top);
+        }
+        h.release_free_space();
+    }
+};
+
+// Mark-sweep that compacts instead of sweeping when the heap is too
+// fragmented. After marking, the gaps between live objects are the
+// free blocks that sweeping would leave. If neither the biggest of
+// those nor the bump room can hold twice the biggest allocation since
+// the last collection, first fit would soon fail again, and if there
+// are more than a few dozen blocks, first fit crawls through them on
+// every allocation. Either way this cycle slides the live objects
+// down instead.
+
+const int HybridDemandFactor = 2;
+const int HybridMaxFreeBlocks = 32;
+
+struct HybridGC: public MarkCompactGC {
+    static const char *name() { return "HYBRID_GC"; }
+
+    static bool fragmented(Heap &h) {
+        int largest = h.size - h.top;
+        int blocks = 0;
+        Loc end = 1;
+        std::set<Loc>::iterator it = h.live.upper_bound(0);
+        for (;; ++it) {
+            Loc next = (it == h.live.end()) ? h.top : *it;
+            if (next - end >= 2) {
+                blocks += 1;
+                largest = std::max(largest, next - end);
+            }
+            if (it == h.live.end()) {
+                break;
+            }
+            end = *it + Obj::at(*it)->size();
+        }
+        return largest < HybridDemandFactor * h.max_alloc_since_gc || blocks > HybridMaxFreeBlocks;
+    }
+
+    static void gc(Heap &h) {
+        h.mark_live<HybridGC>();
+        if (!fragmented(h)) {
+            h.sweep_garbage();
+        }
+        else {
+            Loc old_top = h.top;
+            h.slide_live();
+            if (old_top > h.top) {
+                h.fixup_references<HybridGC>();
+                log_free_mem(h.top, old_top - h.top);
+            }
+        }
+        h.release_free_space();
+    }
+};
+
+struct CopyGC: public NoGC {
+    static const char *name() { return "COPY_GC"; }
+    static const bool logs_marks = false;
+
+    static Loc first_loc(Heap &h) {
+        return (h.top >= h.semi_size) ? h.semi_size : 1;
+    }
+
+    static Loc alloc_limit(Heap &h) {
+        return (h.top >= h.semi_size) ? h.size : h.semi_size;
+    }
+
+    // The halves can only be moved while the live data is in the
+    // lower one, which is every other collection.
+    static Loc min_size(Heap &h) {
+        return (h.top >= h.semi_size) ? 0 : 2 * h.top + 2;
+    }
+
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        return h.loc_after_forwarding_address(loc);
+    }
+
+    static void gc(Heap &h) {
+        h.move_live<CopyGC>();
+        h.fixup_references<CopyGC>();
+        // the idle half is released past what the next collection
+        // copies into it and the program allocates after that
+        long keep = h.top - first_loc(h) + h.release_keep;
+        if (h.top >= h.semi_size) {
+            log_free_mem(1, h.semi_size - 1);
+            h.release_words(1 + keep, h.semi_size);
+        }
+        else {
+            log_free_mem(h.semi_size, h.size - h.semi_size);
+            h.release_words(h.semi_size + keep, h.size);
+        }
+    }
+};
+
+// Switches between copying and compacting by the survival rate of
+// the last collection. Copying costs about the live words L and
+// leaves half the heap H minus L to allocate in, while compacting
+// costs about H and leaves H minus L, so copying is cheaper per
+// allocated word while L is under about 0.29H: in a semispace, a
+// survival rate under about 58%. Copying switches to compacting at
+// 60% survival, which also gives the program the reserved half.
+// Compacting switches back when a compaction keeps 20% or less of
+// the words that were in use before it and leaves the live data in
+// the lower half.
+
+const int AdaptiveCompactPercent = 60;
+const int AdaptiveCopyPercent = 20;
+
+struct AdaptiveGC: public CopyGC {
+    static const char *name() { return "ADAPTIVE_GC"; }
+
+    static Loc first_loc(Heap &h) {
+        return h.semispaces ? CopyGC::first_loc(h) : 1;
+    }
+
+    static Loc alloc_limit(Heap &h) {
+        return h.semispaces ? CopyGC::alloc_limit(h) : h.size;
+    }
+
+    static Loc min_size(Heap &h) {
+        return h.semispaces ? CopyGC::min_size(h) : NoGC::min_size(h);
+    }
+
+    static void gc(Heap &h) {
+        long used = h.top - first_loc(h);
+        if (h.semispaces) {
+            CopyGC::gc(h);
+        }
+        else {
+            MarkCompactGC::gc(h);
+        }
+        long live = h.top - first_loc(h);
+        if (h.semispaces && live * 100 >= used * AdaptiveCompactPercent) {
+            if (h.top >= h.semi_size) {
+                // the old from-space becomes one free block for the
+                // next compaction to slide the live data over
+                FreeBlock *b = (FreeBlock *)(h.heap + 1);
+                h.heap[1] = 0;
+                b->header.type = Obj::TFree;
+                b->len = h.semi_size - 1;
+            }
+            h.semispaces = false;
+        }
+        else if (!h.semispaces && live * 100 <= used * AdaptiveCopyPercent && h.top < h.semi_size) {
+            h.semispaces = true;
+        }
+    }
+};
+
+// Baker's incremental copying uses the same semispaces as COPY_GC,
+// but a collection only flips them and moves the roots. Everything
+// else is copied a little at a time: each allocation first scans a
+// few words of to-space per word allocated, moving what they refer
+// to, and the read barrier moves any from-space object the mutator
+// reaches before the scan does. New objects are allocated at top
+// like copies and get scanned too, which costs a little but keeps
+// to-space one run. A collection that starts while a cycle is still
+// running finishes it first.
+
+const int BakerScanWordsPerWord = 4;
+
+struct BakerGC: public CopyGC {
+    static const char *name() { return "BAKER_GC"; }
+    static const bool starts_cycles = true;
+    static const bool resizes = false; // a collection leaves a cycle running
+
+    struct State {
+        Loc scan; // to-space scan pointer
+
+        State() : scan(0) {}
+    };
+
+    static State &state(Heap &h) { return state_of<BakerGC>(h); }
+
+    static long unused_words(Heap &h) { return alloc_limit(h) - h.top; }
+
+    static bool in_from_space(Heap &h, Loc loc) {
+        return loc != 0 && (loc >= h.semi_size) != (h.top >= h.semi_size);
+    }
+
+    // While a cycle runs the mutator only sees to-space, so a ref to
+    // an object still in from-space moves the object first. If
+    // to-space is full the object stays where it is, and the next
+    // allocation reports the heap exhausted instead of the collector
+    // stopping the program in the middle of a move.
+
+    static Loc read_barrier(Heap &h, Loc loc) {
+        if (!in_from_space(h, loc)) {
+            return loc;
+        }
+        Obj *obj = Obj::at(loc);
+        if (obj->type() == Obj::TForward) {
+            return ((ForwardingAddress *)obj)->to;
+        }
+        if (h.top + obj->size() >= alloc_limit(h)) {
+            h.out_of_room = true;
+            return loc;
+        }
+        bool was_in_gc = h.in_gc;
+        h.in_gc = true;
+        Loc to = h.move(loc);
+        h.in_gc = was_in_gc;
+        return to;
+    }
+
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        return read_barrier(h, loc);
+    }
+
+    static void scan(Heap &h, long budget) {
+        State &s = state(h);
+        while (s.scan < h.top && budget > 0) {
+            Obj *obj = Obj::at(s.scan);
+            UWd size = obj->size();
+            obj->fixup_references<BakerGC>(h);
+            if (h.out_of_room) {
+                return; // the object stays grey
+            }
+            s.scan += size;
+            budget -= size;
+        }
+        if (s.scan >= h.top) {
+            h.collecting = false;
+            h.reads_checked = false;
+            if (h.top >= h.semi_size) {
+                log_free_mem(1, h.semi_size - 1);
+            }
+            else {
+                log_free_mem(h.semi_size, h.size - h.semi_size);
+            }
+        }
+    }
+
+    static void step(Heap &h, UWd n) {
+        scan(h, n * BakerScanWordsPerWord);
+    }
+
+    // The flip only moves the roots, so it fits in a quantum.
+    static bool start_cycle(Heap &h) {
+        gc(h);
+        return true;
+    }
+
+    static void gc(Heap &h) {
+        if (h.collecting) {
+            scan(h, h.size);
+            if (h.out_of_room) {
+                return;
+            }
+        }
+        h.top = (h.top >= h.semi_size) ? 1 : h.semi_size;
+        state(h).scan = h.top;
+        h.collecting = true;
+        h.reads_checked = true;
+        h.fixup_roots<BakerGC>();
+    }
+};
+
+// Brooks-style compaction relocates objects without stopping to fix
+// references. A collection marks the live objects, fixes the refs
+// that still point at old copies and frees the gaps between live
+// objects, which allocation reuses first fit. Then, a few words
+// before each allocation, the highest live objects are copied into
+// the lowest gap below them that fits, and their old copy's Brooks
+// word is pointed at the new one. Refs to old copies keep working
+// through the Brooks word until the next collection fixes them and
+// frees the old copies, which are mostly at the top of the heap.
+// The moves run at allocation safepoints, as the mutator holds raw
+// Obj pointers between them and the heap is single threaded.
+
+const int BrooksMoveWordsPerWord = 2;
+
+struct BrooksGC: public NoGC {
+    static const char *name() { return "BROOKS_GC"; }
+    static const bool brooks_words = true;
+
+    struct State {
+        std::vector<Loc> to_relocate; // live objects, highest last
+    };
+
+    static State &state(Heap &h) { return state_of<BrooksGC>(h); }
+
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        return h.follow(loc);
+    }
+
+    // An object with no gap below it that fits stays put, as gaps
+    // only shrink until the next collection, but the ones after it
+    // may still fit lower down. Trying costs as much as moving.
+
+    static void relocate(Heap &h, long budget) {
+        std::vector<Loc> &to_relocate = state(h).to_relocate;
+        while (budget > 0 && !to_relocate.empty()) {
+            Loc from = to_relocate.back();
+            to_relocate.pop_back();
+            UWd size = Obj::at(from)->size();
+            budget -= size;
+            Loc slot;
+            if (!h.first_fit(size + 1, slot)) {
+                continue;
+            }
+            if (slot >= from - 1) {
+                h.add_free_block(slot, size + 1);
+                continue;
+            }
+            Loc to = slot + 1;
+            log_alloc_mem(slot, size + 1);
+            h.heap[slot] = to;
+            for (int i = 0; i < size; ++i) {
+                h.heap[to + i] = h.heap[from + i];
+            }
+            log_copy_mem(to, from, size);
+            h.heap[from - 1] = to;
+            log_set_ref(h.heap + from - 1, to);
+        }
+        h.collecting = !to_relocate.empty();
+    }
+
+    static void step(Heap &h, UWd n) {
+        relocate(h, n * BrooksMoveWordsPerWord);
+    }
+
+    static void gc(Heap &h) {
+        std::vector<Loc> &to_relocate = state(h).to_relocate;
+        to_relocate.clear();
+        h.collecting = false;
+        h.fixup_roots<BrooksGC>();
+        h.mark_live<BrooksGC>();
+
+        // refs to old copies are fixed lazily, here, and then the old
+        // copies are just more gaps
+        h.free_blocks.clear();
+        Loc end = 1;
+        std::set<Loc>::iterator it;
+        for (it = h.live.begin(); it != h.live.end(); ++it) {
+            Obj *obj = Obj::at(*it);
+            obj->fixup_references<BrooksGC>(h);
+            if (*it - 1 > end) {
+                h.add_free_block(end, *it - 1 - end);
+                log_free_mem(end, *it - 1 - end);
+            }
+            end = *it + obj->size();
+            to_relocate.push_back(*it);
+        }
+        if (end < h.top) {
+            log_free_mem(end, h.top - end);
+            h.top = end;
+        }
+        h.collecting = !to_relocate.empty();
+    }
+};
+
+// Baker's Treadmill is a non-moving incremental collector. Objects
+// live in cells of a few fixed sizes, and each size class has a
+// cyclic doubly linked ring of its cells in four segments, each
+// headed by a sentinel:
+//
+//   to (black, then grey from scan on), fresh, free, from (white)
+//
+// Allocation takes the first free cell into fresh by moving the free
+// sentinel past it, or carves a new cell from the top of the heap.
+// The read barrier and scanning grey a white cell by moving it to the
+// end of to. Each allocation scans a few words of grey cells, which
+// turns them black. Once there is nothing grey, the white cells left
+// in from are garbage. A collection finishes the scan and flips:
+// from joins free, to and fresh become the new from, and flipping
+// the epoch makes every black cell white again without touching it.
+// Then the roots are greyed. Every step is constant time, except
+// that the visualization logs each freed cell.
+
+const int TreadmillScanWordsPerWord = 4;
+const int TreadmillClasses = 32;
+
+struct TreadmillGC: public NoGC {
+    static const char *name() { return "TREADMILL_GC"; }
+    static const bool starts_cycles = true;
+    static const bool resizes = false; // the rings cover the whole heap
+
+    // A ring of cells per size class. The links are side arrays so
+    // that cells hold only their object; ids from the heap's size up
+    // are the segment sentinels.
+    struct Treadmill { int to, fresh, free, from, scan; };
+
+    struct State {
+        std::vector<Treadmill> treadmills;
+        std::vector<int> next;
+        std::vector<int> prev;
+        std::vector<char> mark; // black or grey when it's epoch
+        std::vector<char> size_class;
+        char epoch;
+        int grey;
+        long used; // words in cells that aren't free
+        long kept; // of those, words in to and fresh
+        bool shading; // the read barrier greys white cells
+
+        State() : epoch(0), grey(0), used(0), kept(0), shading(false) {}
+    };
+
+    static State &state(Heap &h) { return state_of<TreadmillGC>(h); }
+
+    // 2, 3, 4, 6, 8, 12, 16, ...
+    static int class_size(int c) {
+        int base = 2 << (c / 2);
+        return (c % 2) ? base + base / 2 : base;
+    }
+
+    static int class_of(UWd n) {
+        int c = 0;
+        while (class_size(c) < n) {
+            ++c;
+        }
+        return c;
+    }
+
+    // All allocation goes through the rings, and the sentinel ids
+    // come right after the heap's words.
+    static Loc alloc_limit(Heap &) { return 0; }
+
+    // free cells of every class and what's left to carve, though a
+    // size with no free cells of its class can still run out first
+    static long unused_words(Heap &h) { return h.size - 1 - state(h).used; }
+
+    static void unlink(Heap &h, int cell) {
+        State &s = state(h);
+        s.next[s.prev[cell]] = s.next[cell];
+        s.prev[s.next[cell]] = s.prev[cell];
+    }
+
+    static void insert_before(Heap &h, int cell, int next) {
+        State &s = state(h);
+        int prev = s.prev[next];
+        s.next[prev] = cell;
+        s.prev[cell] = prev;
+        s.next[cell] = next;
+        s.prev[next] = cell;
+    }
+
+    static void free_words(Heap &h, int begin, int end) {
+        if (end - begin >= 2) {
+            FreeBlock *b = (FreeBlock *)(h.heap + begin);
+            h.heap[begin] = 0;
+            b->header.type = Obj::TFree;
+            b->len = end - begin;
+        }
+        else if (end > begin) {
+            h.heap[begin] = 0; // a nil filler word
+        }
+    }
+
+    static void start(Heap &h) {
+        State &s = state(h);
+        int sentinels = TreadmillClasses * 4;
+        s.next.assign(h.size + sentinels, 0);
+        s.prev.assign(h.size + sentinels, 0);
+        s.mark.assign(h.size, 0);
+        s.size_class.assign(h.size, 0);
+        s.treadmills.resize(TreadmillClasses);
+        for (int c = 0; c < TreadmillClasses; ++c) {
+            Treadmill &t = s.treadmills[c];
+            t.to = h.size + c * 4;
+            t.fresh = t.to + 1;
+            t.free = t.to + 2;
+            t.from = t.to + 3;
+            for (int i = 0; i < 4; ++i) {
+                s.next[t.to + i] = t.to + (i + 1) % 4;
+                s.prev[t.to + i] = t.to + (i + 3) % 4;
+            }
+            t.scan = t.fresh;
+        }
+    }
+
+    static bool bump_in_hole(Heap &h, UWd n, Loc &loc) {
+        State &s = state(h);
+        if (s.treadmills.empty()) {
+            start(h);
+        }
+        int c = class_of(n);
+        Treadmill &t = s.treadmills[c];
+        int cell = s.next[t.free];
+        if (cell >= h.size) {
+            // no free cells, so carve one
+            if (h.top + class_size(c) >= h.size) {
+                return false;
+            }
+            cell = h.top;
+            h.top += class_size(c);
+            s.size_class[cell] = c;
+            insert_before(h, cell, t.free);
+        }
+        else {
+            unlink(h, t.free);
+            insert_before(h, t.free, s.next[cell]);
+        }
+        // the rest of the cell is filler, so the heap can be walked
+        free_words(h, cell + n, cell + class_size(c));
+        s.mark[cell] = s.epoch; // allocated black
+        s.used += class_size(c);
+        s.kept += class_size(c);
+        loc = cell;
+        return true;
+    }
+
+    static void shade(Heap &h, Loc loc) {
+        State &s = state(h);
+        Treadmill &t = s.treadmills[s.size_class[loc]];
+        s.mark[loc] = s.epoch;
+        s.kept += class_size(s.size_class[loc]);
+        unlink(h, loc);
+        insert_before(h, loc, t.fresh);
+        if (t.scan == t.fresh) {
+            t.scan = loc;
+        }
+        s.grey += 1;
+        h.collecting = true;
+    }
+
+    static Loc read_barrier(Heap &h, Loc loc) {
+        State &s = state(h);
+        if (loc && s.mark[loc] != s.epoch) {
+            shade(h, loc);
+        }
+        return loc;
+    }
+
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        return read_barrier(h, loc);
+    }
+
+    // Scanning a cell can grey cells of classes already passed, so
+    // go round again until nothing is grey or the budget is spent.
+
+    static void scan(Heap &h, long budget) {
+        State &s = state(h);
+        while (s.grey > 0 && budget > 0) {
+            for (int c = 0; c < TreadmillClasses && budget > 0; ++c) {
+                Treadmill &t = s.treadmills[c];
+                while (t.scan != t.fresh && budget > 0) {
+                    Obj::at(t.scan)->fixup_references<TreadmillGC>(h);
+                    t.scan = s.next[t.scan];
+                    s.grey -= 1;
+                    budget -= class_size(c);
+                }
+            }
+        }
+        h.collecting = s.grey > 0;
+    }
+
+    static void step(Heap &h, UWd n) {
+        scan(h, n * TreadmillScanWordsPerWord);
+    }
+
+    static bool start_cycle(Heap &h) {
+        State &s = state(h);
+        if (s.treadmills.empty()) {
+            start(h);
+        }
+        flip(h);
+        return true;
+    }
+
+    static void flip(Heap &h) {
+        State &s = state(h);
+        for (int c = 0; c < TreadmillClasses; ++c) {
+            Treadmill &t = s.treadmills[c];
+            if (h.logging) {
+                for (int cell = s.next[t.from]; cell != t.to; cell = s.next[cell]) {
+                    log_free_mem(cell, class_size(c));
+                }
+            }
+            // from joins free and fresh joins to, which becomes from
+            int to = t.to;
+            unlink(h, t.from);
+            unlink(h, t.fresh);
+            t.to = t.from;
+            t.from = to;
+            insert_before(h, t.to, t.free);
+            insert_before(h, t.fresh, t.free);
+            t.scan = t.fresh;
+        }
+        s.used = s.kept; // the white cells in from are free now
+        s.kept = 0;
+        s.epoch ^= 1;
+        s.shading = true;
+        h.reads_checked = true;
+        h.fixup_roots<TreadmillGC>();
+    }
+
+    static void gc(Heap &h) {
+        State &s = state(h);
+        if (s.treadmills.empty()) {
+            start(h);
+        }
+        if (!s.shading) {
+            // nothing has been traced yet, so start a cycle first
+            flip(h);
+        }
+        // The heap is out of cells, so finish this cycle, then run a
+        // whole one to free what died while it was running.
+        for (int i = 0; i < 2; ++i) {
+            scan(h, h.size);
+            flip(h);
+        }
+    }
+};
+
+// Immix divides the heap into blocks of fixed size lines. Marking
+// records which lines hold live data, and allocation bumps through
+// runs of free lines (holes) instead of keeping a free list. Objects
+// bigger than a line that don't fit the current hole take the first
+// later hole they fit, so one medium object doesn't waste the rest of
+// a hole. Each collection also evacuates the live objects of sparse
+// blocks into holes elsewhere, as long as there is room, so the
+// blocks come back whole.
+//
+// The heap has to stay parseable for the walks, so every free run is
+// given FreeBlock headers (or a nil filler word) at each line
+// boundary, and so is the rest of a hole when it's given up.
+
+const int ImmixLineWords = 8;
+const int ImmixBlockLines = 32;
+const int ImmixSparsePercent = 25;
+
+struct ImmixGC: public NoGC {
+    static const char *name() { return "IMMIX_GC"; }
+    static const bool resizes = false; // the free lines run to the end
+
+    struct State {
+        std::vector<char> line_marks; // lines with live data
+        std::vector<std::pair<Loc, Loc> > holes; // free line runs, by address
+        int next_hole;
+        Loc hole_cursor;
+        Loc hole_limit;
+
+        State() : next_hole(0), hole_cursor(0), hole_limit(0) {}
+    };
+
+    static State &state(Heap &h) { return state_of<ImmixGC>(h); }
+
+    static int line_of(Loc loc) { return loc / ImmixLineWords; }
+
+    static void free_words(Heap &h, int begin, int end) {
+        while (begin < end) {
+            int next = (line_of(begin) + 1) * ImmixLineWords;
+            if (next > end) {
+                next = end;
+            }
+            if (next - begin >= 2) {
+                FreeBlock *b = (FreeBlock *)(h.heap + begin);
+                h.heap[begin] = 0;
+                b->header.type = Obj::TFree;
+                b->len = next - begin;
+            }
+            else {
+                h.heap[begin] = 0; // a nil filler word
+            }
+            begin = next;
+        }
+    }
+
+    static void give_up_hole(Heap &h) {
+        State &s = state(h);
+        free_words(h, s.hole_cursor, s.hole_limit);
+        s.hole_cursor = s.hole_limit = 0;
+    }
+
+    static bool bump_in_hole(Heap &h, UWd n, Loc &loc) {
+        State &s = state(h);
+        if (s.hole_cursor + n > s.hole_limit && n > ImmixLineWords) {
+            // medium objects overflow into the first later hole that fits
+            for (int i = s.next_hole; i < (int)s.holes.size(); ++i) {
+                if (s.holes[i].first + n <= s.holes[i].second) {
+                    loc = s.holes[i].first;
+                    s.holes[i].first += n;
+                    free_words(h, s.holes[i].first, s.holes[i].second);
+                    return true;
+                }
+            }
+            return false;
+        }
+        while (s.hole_cursor + n > s.hole_limit) {
+            if (s.next_hole >= (int)s.holes.size()) {
+                return false;
+            }
+            give_up_hole(h);
+            s.hole_cursor = s.holes[s.next_hole].first;
+            s.hole_limit = s.holes[s.next_hole].second;
+            s.next_hole += 1;
+        }
+        loc = s.hole_cursor;
+        s.hole_cursor += n;
+        return true;
+    }
+
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        return h.loc_after_forwarding_map(loc);
+    }
+
+    static void mark_lines(Heap &h) {
+        State &s = state(h);
+        s.line_marks.assign(line_of(h.size - 1) + 1, 0);
+        s.line_marks[0] = 1; // nil never moves
+        std::set<Loc>::iterator it;
+        for (it = h.live.begin(); it != h.live.end(); ++it) {
+            int last = line_of(*it + Obj::at(*it)->size() - 1);
+            for (int line = line_of(*it); line <= last; ++line) {
+                s.line_marks[line] = 1;
+            }
+        }
+    }
+
+    // Runs of free lines, skipping the blocks being evacuated.
+
+    static void find_holes(Heap &h, const std::vector<char> &evacuating) {
+        State &s = state(h);
+        s.holes.clear();
+        s.next_hole = 0;
+        int lines = s.line_marks.size();
+        for (int line = 0; line < lines; ++line) {
+            if (s.line_marks[line] || evacuating[line / ImmixBlockLines]) {
+                continue;
+            }
+            Loc begin = line * ImmixLineWords;
+            while (line + 1 < lines && !s.line_marks[line + 1] &&
+                   !evacuating[(line + 1) / ImmixBlockLines]) {
+                ++line;
+            }
+            int end = (line + 1) * ImmixLineWords;
+            s.holes.push_back(std::make_pair(begin, (end > h.size) ? h.size : end));
+        }
+    }
+
+    static void evacuate(Heap &h, const std::vector<char> &evacuating) {
+        std::vector<Loc> from;
+        std::set<Loc>::iterator it;
+        for (it = h.live.begin(); it != h.live.end(); ++it) {
+            if (evacuating[line_of(*it) / ImmixBlockLines]) {
+                from.push_back(*it);
+            }
+        }
+        for (int i = 0; i < (int)from.size(); ++i) {
+            UWd size = Obj::at(from[i])->size();
+            Loc to;
+            if (!bump_in_hole(h, size, to)) {
+                break; // the rest stay where they are
+            }
+            log_alloc_mem(to, size);
+            for (int w = 0; w < size; ++w) {
+                h.heap[to + w] = h.heap[from[i] + w];
+            }
+            log_copy_mem(to, from[i], size);
+            h.forwarding[from[i]] = to;
+            h.live.erase(from[i]);
+            h.live.insert(to);
+            free_words(h, from[i], from[i] + size);
+            log_free_mem(from[i], size);
+        }
+        give_up_hole(h);
+    }
+
+    static void free_dead_words(Heap &h) {
+        Loc loc = 1;
+        while (loc < h.top) {
+            Loc begin = loc;
+            while (loc < h.top && h.live.count(loc) == 0) {
+                loc += Obj::at(loc)->size();
+            }
+            if (loc > begin) {
+                free_words(h, begin, loc);
+                log_free_mem(begin, loc - begin);
+            }
+            if (loc < h.top) {
+                loc += Obj::at(loc)->size();
+            }
+        }
+    }
+
+    static void gc(Heap &h) {
+        State &s = state(h);
+        give_up_hole(h);
+        if (h.top < h.size) {
+            // from now on all allocation goes through holes
+            free_words(h, h.top, h.size);
+            h.top = h.size;
+        }
+        h.forwarding.clear();
+        h.mark_live<ImmixGC>();
+        mark_lines(h);
+        free_dead_words(h);
+
+        // blocks with only a few live lines are worth emptying
+        int lines = s.line_marks.size();
+        int blocks = (lines + ImmixBlockLines - 1) / ImmixBlockLines;
+        std::vector<int> used(blocks, 0);
+        for (int line = 0; line < lines; ++line) {
+            used[line / ImmixBlockLines] += s.line_marks[line];
+        }
+        std::vector<char> evacuating(blocks, 0);
+        for (int b = 1; b < blocks; ++b) {
+            evacuating[b] = used[b] > 0 && used[b] * 100 <= ImmixBlockLines * ImmixSparsePercent;
+        }
+        find_holes(h, evacuating);
+        evacuate(h, evacuating);
+
+        mark_lines(h);
+        find_holes(h, std::vector<char>(blocks, 0));
+        if (!h.forwarding.empty()) {
+            h.fixup_references<ImmixGC>();
+        }
+    }
+};
+
+// A region collector after G1. The heap is split into fixed-size
+// regions and allocation bumps through one free region at a time.
+// Objects bigger than half a region are humongous: they get a run of
+// whole regions of their own and never move. A collection marks,
+// which also counts the live words of every region, frees the
+// regions with nothing live, and then evacuates the emptiest regions
+// that still have garbage, as many as the pause budget and the free
+// regions allow. Stores of refs go through a write barrier that adds
+// the slot to the remembered set of the region it points into, so
+// fixing refs to the evacuated objects only visits the roots, the
+// moved objects and those slots, not the whole heap. A few regions
+// are held back from allocation so there is always room to
+// evacuate into.
+
+const int RegionWords = 256;
+const int RegionLivePercent = 85; // fuller regions aren't worth it
+const int RegionPauseWords = 2048; // words copied plus slots fixed
+const int RegionReservePercent = 10;
+
+struct RegionGC: public NoGC {
+    static const char *name() { return "REGION_GC"; }
+    static const bool resizes = false; // the regions cover the whole heap
+
+    // For each region its kind, its live words at the last mark, and
+    // the slots in other regions that point into it.
+    enum Kind { Free, Used, Humongous, HumongousTail };
+
+    struct State {
+        std::vector<char> kind;
+        std::vector<int> live;
+        std::vector<std::set<Loc> > remsets;
+        Loc hole_cursor; // bumps through the current region
+        Loc hole_limit;
+
+        State() : hole_cursor(0), hole_limit(0) {}
+    };
+
+    static State &state(Heap &h) { return state_of<RegionGC>(h); }
+
+    static int region_of(Loc loc) { return loc / RegionWords; }
+    static int region_begin(int r) { return r * RegionWords; }
+
+    static int region_end(Heap &h, int r) {
+        return std::min((r + 1) * RegionWords, (int)h.size);
+    }
+
+    static void free_words(Heap &h, int begin, int end) {
+        if (end - begin >= 2) {
+            FreeBlock *b = (FreeBlock *)(h.heap + begin);
+            h.heap[begin] = 0;
+            b->header.type = Obj::TFree;
+            b->len = end - begin;
+        }
+        else if (end > begin) {
+            h.heap[begin] = 0; // a nil filler word
+        }
+    }
+
+    // All allocation goes through regions, and every free region is
+    // one free block, so the heap can still be walked.
+    static Loc alloc_limit(Heap &) { return 0; }
+
+    static void start(Heap &h) {
+        State &s = state(h);
+        int regions = (h.size + RegionWords - 1) / RegionWords;
+        s.kind.assign(regions, Free);
+        s.live.assign(regions, 0);
+        s.remsets.assign(regions, std::set<Loc>());
+        s.kind[0] = Used; // nil never moves
+        h.stores_remembered = true;
+        s.hole_cursor = h.top;
+        s.hole_limit = region_end(h, 0);
+        free_words(h, s.hole_cursor, s.hole_limit);
+        for (int r = 1; r < regions; ++r) {
+            free_words(h, region_begin(r), region_end(h, r));
+        }
+        h.top = h.size;
+    }
+
+    static int free_regions(Heap &h) {
+        State &s = state(h);
+        return std::count(s.kind.begin(), s.kind.end(), (char)Free);
+    }
+
+    // The program may not take the reserved regions, evacuation may.
+    static bool may_take(Heap &h, int regions) {
+        State &s = state(h);
+        int reserve = std::max(1, (int)s.kind.size() * RegionReservePercent / 100);
+        return h.in_gc || free_regions(h) - regions >= reserve;
+    }
+
+    static bool bump_in_hole(Heap &h, UWd n, Loc &loc) {
+        State &s = state(h);
+        if (s.kind.empty()) {
+            start(h);
+        }
+        if (n > RegionWords / 2) {
+            return humongous(h, n, loc);
+        }
+        if (s.hole_cursor + n > s.hole_limit) {
+            int r = 1;
+            while (r < (int)s.kind.size() &&
+                   (s.kind[r] != Free || region_end(h, r) - region_begin(r) < n)) {
+                ++r;
+            }
+            if (r == (int)s.kind.size() || !may_take(h, 1)) {
+                return false;
+            }
+            s.kind[r] = Used;
+            s.hole_cursor = region_begin(r);
+            s.hole_limit = region_end(h, r);
+        }
+        loc = s.hole_cursor;
+        s.hole_cursor += n;
+        free_words(h, s.hole_cursor, s.hole_limit);
+        return true;
+    }
+
+    static bool humongous(Heap &h, UWd n, Loc &loc) {
+        State &s = state(h);
+        int k = (n + RegionWords - 1) / RegionWords;
+        int regions = s.kind.size();
+        for (int r = 1; r + k <= regions; ++r) {
+            int run = 0;
+            while (run < k && s.kind[r + run] == Free) {
+                ++run;
+            }
+            if (run < k) {
+                r += run;
+                continue;
+            }
+            if (region_end(h, r + k - 1) - region_begin(r) < n || !may_take(h, k)) {
+                return false;
+            }
+            s.kind[r] = Humongous;
+            for (int i = 1; i < k; ++i) {
+                s.kind[r + i] = HumongousTail;
+            }
+            loc = region_begin(r);
+            free_words(h, loc + n, region_end(h, r + k - 1));
+            return true;
+        }
+        return false;
+    }
+
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        return h.loc_after_forwarding_map(loc);
+    }
+
+    static void remember(Heap &h, Loc *slot) {
+        State &s = state(h);
+        int to = region_of(*slot);
+        Loc at = h.addr_to_loc(slot);
+        if (*slot && region_of(at) != to && s.kind[to] == Used) {
+            s.remsets[to].insert(at);
+        }
+    }
+
+    static void free_region(Heap &h, int r) {
+        State &s = state(h);
+        s.kind[r] = Free;
+        s.remsets[r].clear();
+        free_words(h, region_begin(r), region_end(h, r));
+        log_free_mem(region_begin(r), region_end(h, r) - region_begin(r));
+    }
+
+    static void free_dead_regions(Heap &h) {
+        State &s = state(h);
+        int regions = s.kind.size();
+        for (int r = 1; r < regions; ++r) {
+            if (s.live[r] > 0) {
+                continue;
+            }
+            if (s.kind[r] == Used) {
+                free_region(h, r);
+            }
+            else if (s.kind[r] == Humongous) {
+                free_region(h, r);
+                while (r + 1 < regions && s.kind[r + 1] == HumongousTail) {
+                    free_region(h, ++r);
+                }
+            }
+        }
+    }
+
+    // The emptiest regions first, while the pause budget lasts, but
+    // always the first one. Objects are at most half a region, so a
+    // free region holds at least that much of the evacuees.
+
+    static std::vector<int> collection_set(Heap &h) {
+        State &s = state(h);
+        std::vector<std::pair<int, int> > candidates;
+        int room = 0;
+        for (int r = 1; r < (int)s.kind.size(); ++r) {
+            int words = region_end(h, r) - region_begin(r);
+            if (s.kind[r] == Free) {
+                room += std::max(0, words - RegionWords / 2);
+            }
+            else if (s.kind[r] == Used &&
+                     s.live[r] * 100 <= words * RegionLivePercent) {
+                candidates.push_back(std::make_pair(s.live[r], r));
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        std::vector<int> chosen;
+        int cost = 0;
+        for (int i = 0; i < (int)candidates.size(); ++i) {
+            int live = candidates[i].first;
+            int r = candidates[i].second;
+            int region_cost = live + s.remsets[r].size();
+            if (live > room || (!chosen.empty() && cost + region_cost > RegionPauseWords)) {
+                break;
+            }
+            chosen.push_back(r);
+            cost += region_cost;
+            room -= live;
+        }
+        return chosen;
+    }
+
+    static void gc(Heap &h) {
+        State &s = state(h);
+        if (s.kind.empty()) {
+            start(h);
+        }
+        s.hole_cursor = s.hole_limit = 0;
+        h.forwarding.clear();
+        h.mark_live<RegionGC>();
+        s.live.assign(s.kind.size(), 0);
+        std::set<Loc>::iterator it;
+        for (it = h.live.begin(); it != h.live.end(); ++it) {
+            if (*it) {
+                s.live[region_of(*it)] += Obj::at(*it)->size();
+            }
+        }
+        free_dead_regions(h);
+
+        std::vector<int> chosen = collection_set(h);
+        std::vector<char> evacuating(s.kind.size(), 0);
+        std::vector<Loc> moved;
+        for (int i = 0; i < (int)chosen.size(); ++i) {
+            int r = chosen[i];
+            evacuating[r] = 1;
+            it = h.live.lower_bound(region_begin(r));
+            for (; it != h.live.end() && *it < region_end(h, r); ++it) {
+                UWd size = Obj::at(*it)->size();
+                Loc to;
+                bool fits = bump_in_hole(h, size, to);
+                assert(fits);
+                log_alloc_mem(to, size);
+                for (int w = 0; w < size; ++w) {
+                    h.heap[to + w] = h.heap[*it + w];
+                }
+                log_copy_mem(to, *it, size);
+                h.forwarding[*it] = to;
+                moved.push_back(to);
+            }
+        }
+
+        // The slots that point into evacuated regions are the roots,
+        // the moved objects and the remembered sets. A remembered
+        // slot may belong to an object that has died since, so it is
+        // only fixed if a live object still has a ref there.
+        h.fixup_roots<RegionGC>();
+        for (int i = 0; i < (int)moved.size(); ++i) {
+            Obj::at(moved[i])->fixup_references<RegionGC>(h);
+            Obj::at(moved[i])->remember_refs(h);
+        }
+        for (int i = 0; i < (int)chosen.size(); ++i) {
+            std::set<Loc>::iterator slot;
+            for (slot = s.remsets[chosen[i]].begin(); slot != s.remsets[chosen[i]].end(); ++slot) {
+                if (evacuating[region_of(*slot)]) {
+                    continue;
+                }
+                it = h.live.upper_bound(*slot);
+                if (it == h.live.begin() || !Obj::at(*--it)->has_ref_at(h.heap + *slot)) {
+                    continue;
+                }
+                Loc to = h.loc_after_forwarding_map(h.heap[*slot]);
+                if (to != h.heap[*slot]) {
+                    h.heap[*slot] = to;
+                    log_set_ref(h.heap + *slot, to);
+                    h.remember(h.heap + *slot);
+                }
+            }
+        }
+        for (int i = 0; i < (int)chosen.size(); ++i) {
+            free_region(h, chosen[i]);
+        }
+    }
+};
+
+template <class Policy>
+class CollectorFor: public Collector {
+  public:
+    typename Policy::State state;
+
+    const char *name() const { return Policy::name(); }
+    bool counts_refs() const { return Policy::counts_refs; }
+    bool brooks_words() const { return Policy::brooks_words; }
+    bool starts_cycles() const { return Policy::starts_cycles; }
+    bool resizes() const { return Policy::resizes; }
+    Loc alloc_limit(Heap &h) { return Policy::alloc_limit(h); }
+    Loc min_size(Heap &h) { return Policy::min_size(h); }
+    long unused_words(Heap &h) { return Policy::unused_words(h); }
+    bool bump_in_hole(Heap &h, UWd n, Loc &loc) { return Policy::bump_in_hole(h, n, loc); }
+    Loc read_barrier(Heap &h, Loc loc) { return Policy::read_barrier(h, loc); }
+    void remember(Heap &h, Loc *slot) { Policy::remember(h, slot); }
+    void step(Heap &h, UWd n) { Policy::step(h, n); }
+    bool start_cycle(Heap &h) { return Policy::start_cycle(h); }
+    void gc(Heap &h) { Policy::gc(h); }
+};
+
+template <class Policy>
+typename Policy::State &state_of(Heap &h) {
+    return static_cast<CollectorFor<Policy> *>(h.collector)->state;
+}
+
+Collector *Collector::named(std::string name) {
+    if (name == NoGC::name()) { return new CollectorFor<NoGC>(); }
+    if (name == RefCountGC::name()) { return new CollectorFor<RefCountGC>(); }
+    if (name == MarkSweepGC::name()) { return new CollectorFor<MarkSweepGC>(); }
+    if (name == MarkCompactGC::name()) { return new CollectorFor<MarkCompactGC>(); }
+    if (name == CopyGC::name()) { return new CollectorFor<CopyGC>(); }
+    if (name == AdaptiveGC::name()) { return new CollectorFor<AdaptiveGC>(); }
+    if (name == HybridGC::name()) { return new CollectorFor<HybridGC>(); }
+    if (name == ImmixGC::name()) { return new CollectorFor<ImmixGC>(); }
+    if (name == BakerGC::name()) { return new CollectorFor<BakerGC>(); }
+    if (name == BrooksGC::name()) { return new CollectorFor<BrooksGC>(); }
+    if (name == TreadmillGC::name()) { return new CollectorFor<TreadmillGC>(); }
+    if (name == RegionGC::name()) { return new CollectorFor<RegionGC>(); }
+    return 0;
+}
+
+Heap::Heap(Collector *c, int _size, int _capacity) : info(std::max(_size, _capacity)) {
+    Heap *previous = current;
+    current = this;
+    assert(_size <= MaxHeapSize && _capacity <= MaxHeapSize);
+    size = _size;
+    capacity = std::max(_size, _capacity);
+    semi_size = size / 2;
+    // an anonymous mapping starts zeroed, and its free pages can be
+    // given back with madvise
+    void *map = mmap(0, capacity * sizeof(UWd), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "can't map a heap of " << capacity << " words\n";
+        exit(1);
+    }
+    heap = (UWd *)map;
+    top = 0;
+    collecting = false;
+    reads_checked = false;
+    stores_remembered = false;
+    out_of_room = false;
+    copy_source = 0;
+    root = 0;
+    collector = c;
+    ref_counting = c->counts_refs();
+    brooks = c->brooks_words();
+    logging = false;
+    in_gc = false;
+    gc_count = 0;
+    gc_seconds = 0;
+    max_pause_seconds = 0;
+    born = std::chrono::steady_clock::now();
+    keep_pauses = false;
+    mmu_goal = 0;
+    mmu_window = 0;
+    window_gc_seconds = 0;
+    step_debt = 0;
+    mmu_missed = false;
+    max_alloc_since_gc = 0;
+    allocated_since_gc = 0;
+    release_keep = 0;
+    semispaces = true;
+    pause_goal = 0;
+    overhead_goal = 0;
+    heap_min = size;
+    heap_max = size;
+    gc_overhead = 0;
+    last_gc_end = 0;
+    measure_live = false;
+    max_live_words = 0;
+    allocs_until_sample = LiveSampleInterval;
+    snap_mode = SnapWords;
+    frame_sink = 0;
+    nil = new ObjRef(ObjRef::SHARE, 0);
+    info.was_allocated(0);
+    top = 1; // heap[0] is nil
+    current = previous;
+}
+
+Heap::~Heap() {
+    Heap *previous = current;
+    current = this;
+    delete nil;
+    munmap(heap, capacity * sizeof(UWd));
+    current = (previous == this) ? 0 : previous;
+}
+
+bool Heap::bump(UWd n, Loc &loc) {
+    if (top + n >= collector->alloc_limit(*this)) {
+        return false;
+    }
+    loc = top;
+    top += n;
+    return true;
+}
+
+// A heap image holds the live data and roots so a later run can skip
+// the work that built them. Locs are offsets from Heap::heap, so an
+// image needs no relocation wherever it is mapped. Saving compacts
+// live objects to the bottom of the heap in address order, like
+// mark-compact, and recomputes ref counts, so an image written under
+// one collector loads under any other.
+//
+// The file is the magic "GCVZIMG1", then words for the version, heap
+// size, top, root count and the roots (not counting nil), then the
+// heap words from 0 to top starting on the next page boundary.
+
+const char ImageMagic[] = "GCVZIMG1";
+const int ImageVersion = 1;
+const int ImageHeaderSize = 4096;
+
+struct ImageRelocation {
+    static Loc loc_after_move(Heap &h, Loc loc) {
+        loc = h.follow(loc); // mid Baker cycle, or an old Brooks copy
+        Loc to = h.loc_after_forwarding_map(loc);
+        h.image_ref_counts[to] += 1;
+        return to;
+    }
+};
+
+void Heap::save_image(const char *file_name) {
+    live_words();
+    forwarding.clear();
+    forwarding[0] = 0;
+    std::vector<UWd> image(heap, heap + 1);
+    std::set<Loc>::iterator it;
+    for (it = live.begin(); it != live.end(); ++it) {
+        if (*it) {
+            forwarding[*it] = image.size();
+            image.insert(image.end(), heap + *it, heap + *it + Obj::at(*it)->size());
+        }
+    }
+
+    image_ref_counts.assign(image.size(), 0);
+    std::map<Loc, Loc>::iterator f;
+    for (f = forwarding.begin(); f != forwarding.end(); ++f) {
+        ((Obj *)&image[f->second])->fixup_references<ImageRelocation>(*this);
+    }
+    std::vector<UWd> header;
+    header.push_back(ImageVersion);
+    header.push_back(size);
+    header.push_back(image.size());
+    header.push_back(0);
+    for (ObjRef *p = root; p; p = p->next) {
+        Loc to = ImageRelocation::loc_after_move(*this, p->loc);
+        if (p != nil) {
+            header.push_back(to);
         }
-#endif
-#endif
-#endif
     }
-
-    static void add_live_loc(Loc loc) {
-        live.insert(loc);
+    header[3] = header.size() - 4;
+    for (f = forwarding.begin(); f != forwarding.end(); ++f) {
+        ((Obj *)&image[f->second])->header.ref_count = image_ref_counts[f->second];
     }
+    std::vector<int>().swap(image_ref_counts);
+    assert(sizeof(ImageMagic) - 1 + header.size() * sizeof(UWd) <= ImageHeaderSize);
+
+    std::vector<char> page(ImageHeaderSize, 0);
+    memcpy(&page[0], ImageMagic, sizeof(ImageMagic) - 1);
+    memcpy(&page[sizeof(ImageMagic) - 1], &header[0], header.size() * sizeof(UWd));
+    std::ofstream out(file_name, std::ios::out | std::ios::binary);
+    out.write(&page[0], page.size());
+    out.write((const char *)&image[0], image.size() * sizeof(UWd));
+}
 
-    static void log_roots(std::string msg) {
-        ObjRef *p = ObjRef::root;
-        std::cout << "['bp','" << msg << "'],\n";
-        std::cout << "['roots'";
-        live.clear();
-        while (p) {
-            Loc loc = p->loc;
-            std::cout << "," << loc;
-            live.insert(loc);
-            Obj::at(loc)->traverse(add_live_loc);
-            p = p->next;
+// The image is mapped read-only and copied into this heap, which may
+// be a different size as long as the live data fits. The caller
+// adopts the returned roots, e.g. with ObjRef::adopt. The header and
+// roots are checked against the file, so a truncated or corrupt image
+// is refused rather than read past its end.
+
+bool Heap::load_image(const char *file_name, std::vector<Loc> &roots) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < ImageHeaderSize) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    const char *base = (const char *)map;
+    const UWd *header = (const UWd *)(base + sizeof(ImageMagic) - 1);
+    int image_top = header[2];
+    int root_count = header[3];
+    bool ok = memcmp(base, ImageMagic, sizeof(ImageMagic) - 1) == 0 &&
+              header[0] == ImageVersion &&
+              sizeof(ImageMagic) - 1 + (4 + root_count) * sizeof(UWd) <= (size_t)ImageHeaderSize &&
+              image_top >= 1 && image_top < size &&
+              ImageHeaderSize + image_top * (off_t)sizeof(UWd) <= st.st_size;
+    for (int i = 0; ok && i < root_count; ++i) {
+        ok = header[4 + i] < image_top;
+    }
+    if (ok) {
+        const UWd *image = (const UWd *)(base + ImageHeaderSize);
+        free_blocks.clear();
+        roots.assign(header + 4, header + 4 + root_count);
+        if (brooks || image_top >= collector->alloc_limit(*this)) {
+            ok = load_object_by_object(image, image_top, roots);
         }
-        std::cout << "],\n";
-        std::cout << "['live'";
-        std::set<Loc>::iterator it;
-        for (it = live.begin(); it != live.end(); ++it) {
-            std::cout << "," << *it;
+        else {
+            memcpy(heap, image, image_top * sizeof(UWd));
+            top = image_top;
+            log_alloc_mem(1, top - 1);
         }
-        std::cout << "],\n";
     }
+    munmap(map, st.st_size);
+    return ok;
+}
 
-    static char color_of_mem_loc(Loc loc) {
-        MemInfo &info = Mem::info[loc];
-        if (info.is_allocated) {
-            const char *color;
-            int age;
-            if (info.last_read > info.last_write) {
-                color = "0123456789";
-                age = info.time - info.last_read;
-            }
-            else {
-                color = "abcdefghij";
-                age = info.time - info.last_write;
-            }
-            if (age == info.time) { return '+'; }
-            if (age < 5) {
-                return info.is_overhead ? '#' : color[0];
-            }
-            if (age < 25) { return color[1]; }
-            if (age < 125) { return color[2]; }
-            return color[3];
-        }
-        else {
-            return ' ';
+// Images are packed, so when the collector can't take them as they
+// are, like BROOKS_GC with its Brooks words or TREADMILL_GC with its
+// cells, each object is allocated on its own and the refs are
+// relocated to match.
+
+bool Heap::load_object_by_object(const UWd *image, int image_top, std::vector<Loc> &roots) {
+    forwarding.clear();
+    forwarding[0] = 0;
+    in_gc = true; // a fresh heap has nothing to collect
+    for (int from = 1; from < image_top; ) {
+        UWd n = ((Obj *)(image + from))->size();
+        if (n == 0 || from + n > image_top) {
+            in_gc = false;
+            return false; // objects run past the image
         }
+        Loc to = reserve_object(n);
+        memcpy(heap + to, image + from, n * sizeof(UWd));
+        forwarding[from] = to;
+        from += n;
     }
+    in_gc = false;
+    std::map<Loc, Loc>::iterator f;
+    for (f = forwarding.begin(); f != forwarding.end(); ++f) {
+        Obj::at(f->second)->fixup_references<MarkCompactGC>(*this);
+        Obj::at(f->second)->remember_refs(*this);
+    }
+    for (int i = 0; i < (int)roots.size(); ++i) {
+        roots[i] = loc_after_forwarding_map(roots[i]);
+    }
+    return true;
+}
 
-    // Try to stay under the 2MB spin limit for the resulting animation.
+// Only a heap with logging turned on writes frames, and the output
+// streams are shared, so log one heap at a time.
 
-    static void snap() {
-        static int frame = 0;
-        char xpm_file_name[20];
-        sprintf(xpm_file_name, "img%08d.xpm", frame++);
+void log_start() { Heap::current->logging = true; }
+void log_stop() { Heap::current->logging = false; }
+#define log_ready (Heap::current->logging)
+#define log_msg(M) if (log_ready) { std::cout << M; Heap::current->snap(); }
 
-        std::ofstream xpm_file;
-        xpm_file.open(xpm_file_name);
+// The binary trace is a compact alternative to frame_content for
+// runs too big for the browser to eval. It starts with the magic
+// "GCVZ", a version and the heap size, then has one record per
+// frame: an opcode byte followed by little-endian 16-bit operands.
+// docs/engine.js reads it with a DataView.
 
-        xpm_file << "/* XPM */\n"
-                 << "static char * plaid[] =\n"
-                 << "{\n"
-                 << "/* width height ncolors chars_per_pixel */\n"
-                 << "\"" << ImageWidth << " " << ImageHeight << " 11 1\",\n"
-                 << "/* colors */\n"
-                 << "\"  c black\",\n"
-                 << "\"+ c #888888\",\n"
-                 << "\"# c #ff0000\",\n"
-                 << "\"0 c #00ff00\",\n" // 22ee22
-                 << "\"1 c #22cc22\",\n"
-                 << "\"2 c #22aa22\",\n"
-                 << "\"3 c #228822\",\n"
-                 << "\"a c #ffff00\",\n" // eeee22
-                 << "\"b c #cccc22\",\n"
-                 << "\"c c #aaaa22\",\n"
-                 << "\"d c #888822\",\n"
-                 << "/* pixels */\n";
-
-        char row[ImageWordSize][ImageWidth + 1];
-        for (int py = 0; py < ImageWordSize; ++py) {
-            row[py][ImageWidth] = 0;
-        }
-
-        int loc_x = 0;
-        for (Loc loc = 0; loc < HeapSize; ++loc) {
-            char c = color_of_mem_loc(loc);
-
-            for (int py = 0; py < ImageWordSize; ++py) {
-                for (int px = 0; px < ImageWordSize; ++px) {
-                    row[py][loc_x + px] = c;
-                }
-            }
-#if 0
-            if (loc % (frame + 6) == 0) {
-                row[1][loc_x + 1] = '#';
-            }
-#endif
-            loc_x += ImageWordSize;
+enum TraceOp {
+    OpAlloc=1, OpFree=2, OpInit=3, OpRefCount=4, OpSetChar=5, OpSetNum=6,
+    OpSetRef=7, OpCopy=8, OpBp=9, OpRoots=10, OpLive=11, OpStop=12
+};
 
-            if (loc_x == ImageWidth) {
-                for (int py = 0; py < ImageWordSize; ++py) {
-                    xpm_file << "\"" << row[py] << "\",\n";
-                }
-                loc_x = 0;
-            }
-        }
+const int TraceVersion = 1;
 
-        xpm_file << "};\n";
-        xpm_file.close();
+static std::ofstream bin_trace;
+
+void trace_wd(int val) {
+    bin_trace.put(char(val & 0xff));
+    bin_trace.put(char((val >> 8) & 0xff));
+}
+
+void trace_open(const char *file_name, int heap_size) {
+    bin_trace.open(file_name, std::ios::out | std::ios::binary);
+    bin_trace.write("GCVZ", 4);
+    trace_wd(TraceVersion);
+    trace_wd(heap_size);
+}
+
+bool trace_bin_ready() { return log_ready && bin_trace.is_open(); }
+
+void trace_bin(TraceOp op) {
+    if (trace_bin_ready()) {
+        bin_trace.put(char(op));
     }
-};
+}
+
+void trace_bin(TraceOp op, int a, int b) {
+    if (trace_bin_ready()) {
+        bin_trace.put(char(op));
+        trace_wd(a);
+        trace_wd(b);
+    }
+}
 
-uint MemInfo::time = 0;
-UWd Mem::heap[HeapSize];
-MemInfo Mem::info[HeapSize];
-Loc Mem::top = 0;
-std::map<Loc,Loc> Mem::forwarding;
-std::set<Loc> Mem::live;
+void trace_bin(TraceOp op, int a, int b, int c) {
+    if (trace_bin_ready()) {
+        bin_trace.put(char(op));
+        trace_wd(a);
+        trace_wd(b);
+        trace_wd(c);
+    }
+}
 
-ObjRef *ObjRef::root = 0;
-ObjRef *ObjRef::nil = new ObjRef(ObjRef::SHARE, 0);
+void trace_bin(TraceOp op, std::string msg) {
+    if (trace_bin_ready()) {
+        bin_trace.put(char(op));
+        trace_wd(msg.length());
+        bin_trace.write(msg.data(), msg.length());
+    }
+}
 
-static bool log_ready = false;
-void log_start() { log_ready = true; }
-void log_stop() { log_ready = false; }
-#define log_msg(M) if (log_ready) { std::cout << M; Mem::snap(); }
+void Heap::log_roots(std::string msg) {
+    if (!logging) {
+        return;
+    }
+    ObjRef *p;
+    std::cout << "['bp','" << msg << "'],\n";
+    trace_bin(OpBp, msg);
+    std::cout << "['roots'";
+    int root_count = 0;
+    for (p = root; p; p = p->next) {
+        ++root_count;
+    }
+    trace_bin(OpRoots);
+    if (trace_bin_ready()) {
+        trace_wd(root_count);
+    }
+    live.clear();
+    for (p = root; p; p = p->next) {
+        Loc loc = p->loc;
+        std::cout << "," << loc;
+        if (trace_bin_ready()) {
+            trace_wd(loc);
+        }
+        live.insert(loc);
+        Obj::at(loc)->traverse(add_live_loc);
+    }
+    std::cout << "],\n";
+    std::cout << "['live'";
+    trace_bin(OpLive);
+    if (trace_bin_ready()) {
+        trace_wd(live.size());
+    }
+    std::set<Loc>::iterator it;
+    for (it = live.begin(); it != live.end(); ++it) {
+        std::cout << "," << *it;
+        if (trace_bin_ready()) {
+            trace_wd(*it);
+        }
+    }
+    std::cout << "],\n";
+}
 
 void log_alloc_mem(Loc loc, int size) {
     for (int i = 0; i < size; ++i) {
-        Mem::info[loc + i].was_allocated();
+        Heap::current->info.was_allocated(loc + i);
     }
+    trace_bin(OpAlloc, loc, size);
     log_msg("['alloc'," << loc << ',' << size << "],\n");
 }
 
 void log_free_mem(Loc loc, int size) {
     for (int i = 0; i < size; ++i) {
-        Mem::info[loc + i].was_freed();
+        Heap::current->info.was_freed(loc + i);
     }
+    trace_bin(OpFree, loc, size);
     log_msg("['free'," << loc << ',' << size << "],\n");
 }
 
-void log_init_obj(void *addr, const char *type) {
+void log_init_obj(void *addr, int type) {
     if (log_ready) {
-        std::cout << "['init'," << Mem::addr_to_loc(addr) << ",'" << type << "'],\n";
+        Loc loc = Heap::current->addr_to_loc(addr);
+        std::cout << "['init'," << loc << ",'" << Obj::TypeName[type] << "'],\n";
+        trace_bin(OpInit, loc, type);
     }
 }
 
 void log_ref_count(Loc loc, int ref_count) {
-    Mem::info[loc].was_overhead();
+    Heap::current->info.was_overhead(loc);
+    trace_bin(OpRefCount, loc, ref_count);
     log_msg("['ref_count'," << loc << "," << ref_count << "],\n");
 }
 
 void log_ref_count(void *addr, int ref_count) {
-    log_ref_count(Mem::addr_to_loc(addr), ref_count);
+    log_ref_count(Heap::current->addr_to_loc(addr), ref_count);
 }
 
 void log_get_val(const void *addr) {
-    Loc loc = Mem::addr_to_loc(addr);
-    Mem::info[loc].was_read();
+    Loc loc = Heap::current->addr_to_loc(addr);
+    Heap::current->info.was_read(loc);
     if (log_ready) {
-        Mem::snap();
+        Heap::current->snap();
     }
 }
 
 void log_set_val(void *addr, char val) {
-    Loc loc = Mem::addr_to_loc(addr);
-    Mem::info[loc].was_written();
+    Loc loc = Heap::current->addr_to_loc(addr);
+    Heap::current->info.was_written(loc);
+    trace_bin(OpSetChar, loc, (unsigned char)val);
     log_msg("['set'," << loc << ",\"'" << val << "\"],\n");
 }
 
 void log_set_val(void *addr, int val) {
-    Loc loc = Mem::addr_to_loc(addr);
-    Mem::info[loc].was_written();
+    Loc loc = Heap::current->addr_to_loc(addr);
+    Heap::current->info.was_written(loc);
+    trace_bin(OpSetNum, loc, val);
     log_msg("['set'," << loc << ",'=" << val << "'],\n");
 }
 
 void log_set_ref(void *addr, Loc val) {
-    Loc loc = Mem::addr_to_loc(addr);
-    Mem::info[loc].was_written();
+    Loc loc = Heap::current->addr_to_loc(addr);
+    Heap::current->info.was_written(loc);
+    trace_bin(OpSetRef, loc, val);
     log_msg("['set'," << loc << "," << val << "],\n");
 }
 
 void log_copy_mem(Loc to, Loc from, int size) {
     for (int i = 0; i < size; ++i) {
-        Mem::info[from + i].was_read();
-        Mem::info[to + i].was_written();
+        Heap::current->info.was_read(from + i);
+        Heap::current->info.was_written(to + i);
     }
+    trace_bin(OpCopy, to, from, size);
     log_msg("['copy'," << to << ',' << from << ',' << size << "],\n");
 }
 
 void log_copy_mem(void *to, void *from, int size) {
-    log_copy_mem(Mem::addr_to_loc(to), Mem::addr_to_loc(from), size);
+    log_copy_mem(Heap::current->addr_to_loc(to), Heap::current->addr_to_loc(from), size);
+}
+
+void Obj::init_ref_count() {
+    if (Heap::current->ref_counting) {
+        header.ref_count = 1;
+        log_ref_count(&header, header.ref_count);
+    }
+    else {
+        header.ref_count = 0;
+    }
+}
+
+void Obj::inc_ref_count() {
+    if (Heap::current->ref_counting) {
+        header.ref_count += 1;
+        log_ref_count(&header, header.ref_count);
+    }
+}
+
+bool Obj::dec_ref_count() {
+    if (Heap::current->ref_counting) {
+        header.ref_count -= 1;
+        log_ref_count(&header, header.ref_count);
+        if (header.ref_count == 0) {
+            cleanup();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ObjRef::add_to_root_set() {
+    prev = 0;
+    if (heap->root) {
+        heap->root->prev = this;
+        next = heap->root;
+    }
+    else {
+        next = 0;
+    }
+    heap->root = this;
 }
 
 ObjRef::ObjRef(RefType type, UWd loc_or_size, UWd new_size) {
+    heap = Heap::current;
     switch (type) {
         case ALLOC:
-            loc = Mem::alloc(loc_or_size);
+            loc = heap->alloc(loc_or_size);
             referenced_Obj()->init_ref_count();
             break;
         case COPY:
-            loc = Mem::copy(loc_or_size, new_size);
+            loc = heap->copy(loc_or_size, new_size);
             referenced_Obj()->init_ref_count();
             break;
         case SHARE:
-            loc = Mem::read_barrier(loc_or_size);
+            loc = heap->read_barrier(loc_or_size);
             referenced_Obj()->inc_ref_count();
             break;
+        case ADOPT:
+            // a root saved in a heap image, already counted
+            loc = loc_or_size;
+            break;
     }
     add_to_root_set();
 }
 
 ObjRef::ObjRef(const ObjRef &that) {
-    loc = Mem::read_barrier(that.loc);
+    heap = that.heap;
+    assert(heap == Heap::current);
+    loc = heap->read_barrier(that.loc);
     referenced_Obj()->inc_ref_count();
     add_to_root_set();
 }
 
 ObjRef::~ObjRef() {
+    assert(heap == Heap::current);
     if (next) { next->prev = prev; }
     if (prev) { prev->next = next; }
-    if (root == this) {
-        root = next;
+    if (heap->root == this) {
+        heap->root = next;
     }
     if (referenced_Obj()->dec_ref_count()) {
-        Mem::free(loc, referenced_Obj()->size());
+        heap->free(loc, referenced_Obj()->size());
     }
     prev = 0;
     next = 0;
@@ -689,7 +3103,7 @@ ObjRef::~ObjRef() {
 }
 
 Loc ObjRef::share() {
-    loc = Mem::read_barrier(loc);
+    loc = heap->read_barrier(loc);
     referenced_Obj()->inc_ref_count();
     return loc;
 }
@@ -698,7 +3112,7 @@ void ObjRef::unshare(Loc loc) {
     if (loc) {
         Obj *obj = Obj::at(loc);
         if (obj->dec_ref_count()) {
-            Mem::free(loc, obj->size());
+            Heap::current->free(loc, obj->size());
         }
     }
 }
@@ -752,7 +3166,10 @@ class Tup: public Obj {
         log_set_val(&len, len);
         // due to the shallow copy constructor, there may be initial
         // values in this tuple which need their ref counts bumped.
+        // They are reads, so they also go through the read barrier.
         for (int i = 0; i < len; ++i) {
+            val[i] = Heap::current->read_barrier(val[i]);
+            Heap::current->remember(&val[i]);
             if (val[i]) {
                 Obj::at(val[i])->inc_ref_count();
             }
@@ -774,20 +3191,36 @@ class Tup: public Obj {
         Loc tmp = obj.share();
         ObjRef::unshare(val[i]);
         val[i] = tmp;
+        Heap::current->remember(&val[i]);
         log_set_ref(val + i, val[i]);
     }
 
+    // Traversal and dumping follow Brooks words and the forwarding
+    // addresses left behind in the middle of an incremental copy.
+
     void traverse(VisitFn f) const {
         for (int i = 0; i < len; ++i) {
             log_get_val(&val[i]);
-            f(val[i]);
-            Obj::at(val[i])->traverse(f);
+            Loc loc = Heap::current->follow(val[i]);
+            f(loc);
+            Obj::at(loc)->traverse(f);
         }
     }
 
-    void fixup_references() {
+    void remember_refs(Heap &h) {
+        for (int i = 0; i < len; ++i) {
+            h.remember(&val[i]);
+        }
+    }
+
+    bool has_ref_at(const Loc *slot) const {
+        return slot >= val && slot < val + len;
+    }
+
+    template <class Policy>
+    void fixup_references(Heap &h) {
         for (int i = 0; i < len; ++i) {
-            val[i] = Mem::loc_after_move(val[i]);
+            val[i] = Policy::loc_after_move(h, val[i]);
         }
     }
 
@@ -805,7 +3238,7 @@ class Tup: public Obj {
             if (i > 0) {
                 std::cout << ',';
             }
-            Obj::at(val[i])->dump();
+            Obj::at(Heap::current->follow(val[i]))->dump();
         }
         std::cout << ']';
     }
@@ -823,6 +3256,9 @@ class TupRef: public ObjRef {
     TupRef(Loc src, int len) : ObjRef(COPY, src, Tup::size_needed(len)) {
         cast_Tup()->init(len);
     }
+    TupRef(ObjRef that) : ObjRef(that) {
+        assert(that.type() == Obj::TTup);
+    }
 
     int length() const { return cast_Tup()->len; }
     ObjRef get(int i) const { return cast_Tup()->get(i); }
@@ -838,14 +3274,20 @@ class Vec: public Obj {
         Obj::init(TVec);
         len = 0;
         tup = _tup; // caller already incremented ref count
+        Heap::current->remember(&tup);
         log_set_val(&len, len);
         log_set_ref(&tup, tup);
     }
 
+    // tup is read through the read barrier like any other ref.
+
+    Loc tup_loc() const { return Heap::current->read_barrier(tup); }
+    Tup *tup_obj() const { return Tup::at(tup_loc()); }
+
     ObjRef get(int i) const {
         assert(i < len);
         log_get_val(&tup);
-        return Tup::at(tup)->get(i);
+        return tup_obj()->get(i);
     }
 
     ObjRef get(int i, int j) const {
@@ -864,26 +3306,31 @@ class Vec: public Obj {
     void set(int i, ObjRef obj) {
         assert(i < len);
         log_get_val(&tup);
-        Tup::at(tup)->set(i, obj);
+        tup_obj()->set(i, obj);
     }
 
     void traverse(VisitFn f) const {
         log_get_val(&tup);
-        f(tup);
-        Tup::at(tup)->traverse(f);
+        Loc loc = Heap::current->follow(tup);
+        f(loc);
+        Tup::at(loc)->traverse(f);
     }
 
-    void fixup_references() {
-        tup = Mem::loc_after_move(tup);
+    template <class Policy>
+    void fixup_references(Heap &h) {
+        tup = Policy::loc_after_move(h, tup);
     }
 
+    void remember_refs(Heap &h) { h.remember(&tup); }
+    bool has_ref_at(const Loc *slot) const { return slot == &tup; }
+
     void cleanup() {
         ObjRef::unshare(tup);
         tup = 0;
     }
 
     UWd size() const { return size_needed(len); }
-    void dump() const { Tup::at(tup)->dump_up_to(len); }
+    void dump() const { Tup::at(Heap::current->follow(tup))->dump_up_to(len); }
     static UWd size_needed(int len) { return sizeof(Vec) / sizeof(UWd); }
 };
 
@@ -904,14 +3351,17 @@ class VecRef: public ObjRef {
     void set(int i, ObjRef obj) { cast_Vec()->set(i, obj); }
 
     void push(ObjRef obj) {
-        std::cout << "// push "; obj.dump(); std::cout << '\n';
+        if (log_ready) {
+            std::cout << "// push "; obj.dump(); std::cout << '\n';
+        }
         Vec *vec = cast_Vec();
-        Tup *tup = Tup::at(vec->tup);
+        Tup *tup = vec->tup_obj();
         if (tup->len == vec->len) {
-            Loc new_tup = TupRef(vec->tup, 2 * vec->len).share();
+            Loc new_tup = TupRef(vec->tup_loc(), 2 * vec->len).share();
             vec = cast_Vec();
             ObjRef::unshare(vec->tup);
             vec->tup = new_tup;
+            Heap::current->remember(&vec->tup);
             tup = Tup::at(vec->tup);
             log_set_ref(&vec->tup, vec->tup);
         }
@@ -970,6 +3420,15 @@ class Str: public Obj {
         return found + 1;
     }
 
+    std::string to_s() const {
+        std::string s;
+        for (int i = 0; i < len; ++i) {
+            log_get_val(&val[i]);
+            s += char(val[i]);
+        }
+        return s;
+    }
+
     void copy(int begin, int end, Str *dest) {
         for (int i = 0; i < end - begin; ++i) {
             dest->val[i] = val[begin + i];
@@ -1036,6 +3495,12 @@ class StrRef: public ObjRef {
         cast_Str()->init(len);
     }
 
+    StrRef(ObjRef that) : ObjRef(that) {
+        assert(that.type() == Obj::TStr);
+    }
+
+    std::string to_s() const { return cast_Str()->to_s(); }
+
     VecRef split(char sep) {
         int begin[5];
         int end[5];
@@ -1054,7 +3519,11 @@ class StrRef: public ObjRef {
 const char *Obj::TypeName[] = { ":nil ", ":* ", ":- ", ":n ", ":<> ", ":[] ", ":s " };
 
 Obj *Obj::at(Loc loc) {
-    return (Obj *)(Mem::heap + loc);
+    Heap *h = Heap::current;
+    if (h->brooks && loc) {
+        loc = h->heap[loc - 1];
+    }
+    return (Obj *)(h->heap + loc);
 }
 
 void Obj::traverse(VisitFn f) const {
@@ -1068,17 +3537,40 @@ void Obj::traverse(VisitFn f) const {
     }
 }
 
-void Obj::fixup_references() {
+template <class Policy>
+void Obj::fixup_references(Heap &h) {
+    switch (type()) {
+        case TTup:
+            return ((Tup *)this)->fixup_references<Policy>(h);
+        case TVec:
+            return ((Vec *)this)->fixup_references<Policy>(h);
+        default:
+            return;
+    }
+}
+
+void Obj::remember_refs(Heap &h) {
     switch (type()) {
         case TTup:
-            return ((Tup *)this)->fixup_references();
+            return ((Tup *)this)->remember_refs(h);
         case TVec:
-            return ((Vec *)this)->fixup_references();
+            return ((Vec *)this)->remember_refs(h);
         default:
             return;
     }
 }
 
+bool Obj::has_ref_at(const Loc *slot) const {
+    switch (type()) {
+        case TTup:
+            return ((Tup *)this)->has_ref_at(slot);
+        case TVec:
+            return ((Vec *)this)->has_ref_at(slot);
+        default:
+            return false;
+    }
+}
+
 void Obj::cleanup() {
     switch (type()) {
         case TTup:
@@ -1176,46 +3668,391 @@ standings = dkp_log.group_by { |trans| trans[1] }.map { |person, history|
 
 */
 
+// Options and set up shared by dkp.exe and the other workload
+// programs, so every workload gets the same collectors, frames and
+// benchmark instrumentation.
+
+struct RunOptions {
+    const char *trace_file_name;
+    const char *frames_spec;
+    const char *gc_name;
+    Heap::SnapMode snap_mode;
+    int heap_size;
+    bool bench;
+    bool measure_live;
+    double mmu_goal;
+    double mmu_window;
+    const char *mmu_curve_file_name;
+    double pause_goal;
+    double overhead_goal;
+    int heap_min;
+    int heap_max;
+    bool heap_bounds; // --heap-min or --heap-max given
+    std::chrono::steady_clock::time_point start;
+
+    RunOptions() {
+        trace_file_name = 0;
+        frames_spec = "xpm";
+        gc_name = "MARK_SWEEP_GC";
+        snap_mode = Heap::SnapWords;
+        heap_size = HeapSize;
+        bench = false;
+        measure_live = false;
+        mmu_goal = 0;
+        mmu_window = 0.010;
+        mmu_curve_file_name = 0;
+        pause_goal = 0;
+        overhead_goal = 0;
+        heap_min = 100;
+        heap_max = MaxHeapSize;
+        heap_bounds = false;
+    }
+
+    // With a sizing goal, --heap is only where the heap starts.
+    bool sizing() const { return pause_goal > 0 || overhead_goal > 0; }
+    int capacity() const { return sizing() ? heap_max : heap_size; }
+
+    void configure(Heap *heap) {
+        heap->measure_live = measure_live;
+        heap->mmu_goal = mmu_goal;
+        heap->mmu_window = mmu_window;
+        if (sizing()) {
+            heap->pause_goal = pause_goal;
+            heap->overhead_goal = overhead_goal;
+            heap->heap_min = heap_min;
+            heap->heap_max = heap_max;
+        }
+    }
+
+    // Returns false if arg isn't one of the shared options.
+    bool parse(const char *arg) {
+        std::string a(arg);
+        if (a.compare(0, 8, "--trace=") == 0) {
+            trace_file_name = arg + 8;
+        }
+        else if (a.compare(0, 5, "--gc=") == 0) {
+            gc_name = arg + 5;
+        }
+        else if (a.compare(0, 9, "--frames=") == 0) {
+            frames_spec = arg + 9;
+        }
+        else if (a == "--heat=recency") {
+            snap_mode = Heap::SnapRecency;
+        }
+        else if (a == "--heat=occupancy") {
+            snap_mode = Heap::SnapOccupancy;
+        }
+        else if (a == "--heat=state") {
+            snap_mode = Heap::SnapState;
+        }
+        else if (a.compare(0, 7, "--heap=") == 0) {
+            heap_size = atoi(arg + 7);
+        }
+        else if (a == "--bench") {
+            bench = true;
+        }
+        else if (a == "--measure-live") {
+            measure_live = true;
+        }
+        else if (a.compare(0, 6, "--mmu=") == 0) {
+            // percent utilization, then optionally /window in ms
+            int percent = atoi(arg + 6);
+            const char *slash = strchr(arg + 6, '/');
+            mmu_goal = percent / 100.0;
+            if (slash) {
+                mmu_window = atof(slash + 1) / 1000;
+            }
+        }
+        else if (a.compare(0, 12, "--mmu-curve=") == 0) {
+            mmu_curve_file_name = arg + 12;
+        }
+        else if (a.compare(0, 13, "--pause-goal=") == 0) {
+            pause_goal = atof(arg + 13) / 1000; // ms
+        }
+        else if (a.compare(0, 14, "--gc-overhead=") == 0) {
+            overhead_goal = atof(arg + 14) / 100; // percent
+        }
+        else if (a.compare(0, 11, "--heap-min=") == 0) {
+            heap_min = atoi(arg + 11);
+            heap_bounds = true;
+        }
+        else if (a.compare(0, 11, "--heap-max=") == 0) {
+            heap_max = atoi(arg + 11);
+            heap_bounds = true;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+};
+
+// The run's frame sink is also closed at exit, so a run that ends
+// with heap exhausted still leaves a raw file with its index.
+
+FrameSink *run_frame_sink = 0;
+
+void close_frame_sink() {
+    if (run_frame_sink) {
+        run_frame_sink->close();
+        delete run_frame_sink;
+        run_frame_sink = 0;
+    }
+}
+
+// Makes the heap current and starts logging unless benchmarking.
+// Returns 0 if the options are bad.
+
+Heap *start_run(RunOptions &o) {
+    Collector *collector = Collector::named(o.gc_name);
+    if (!collector) {
+        std::cerr << "unknown collector " << o.gc_name << '\n';
+        return 0;
+    }
+    if (o.heap_size < 100 || o.heap_size > MaxHeapSize) {
+        std::cerr << "heap size must be between 100 and " << MaxHeapSize << " words\n";
+        return 0;
+    }
+    if (o.mmu_goal < 0 || o.mmu_goal >= 1 || o.mmu_window <= 0) {
+        std::cerr << "--mmu needs a utilization below 100% and a positive window\n";
+        return 0;
+    }
+    if (o.mmu_goal > 0 && !collector->starts_cycles()) {
+        std::cerr << "--mmu needs a collector that runs its cycles incrementally, "
+                  << o.gc_name << " stops the program for them\n";
+        return 0;
+    }
+    if (o.heap_bounds && !o.sizing()) {
+        std::cerr << "--heap-min and --heap-max need --pause-goal or --gc-overhead\n";
+        return 0;
+    }
+    if (o.sizing() && !collector->resizes()) {
+        std::cerr << o.gc_name << " keeps the heap size it starts with, so it can't be sized\n";
+        return 0;
+    }
+    if (o.sizing() && (o.heap_min < 100 || o.heap_min > o.heap_size ||
+                       o.heap_max < o.heap_size || o.heap_max > MaxHeapSize)) {
+        std::cerr << "heap sizing needs 100 <= --heap-min <= --heap <= --heap-max <= " << MaxHeapSize << '\n';
+        return 0;
+    }
+    if (o.overhead_goal >= 1) {
+        std::cerr << "--gc-overhead must be under 100%\n";
+        return 0;
+    }
+    run_frame_sink = FrameSink::open(o.frames_spec);
+    if (!run_frame_sink) {
+        std::cerr << "--frames must be xpm, raw:FILE or y4m:FILE\n";
+        return 0;
+    }
+    atexit(close_frame_sink);
+    Heap *heap = new Heap(collector, o.heap_size, o.capacity());
+    Heap::current = heap;
+
+    heap->snap_mode = o.snap_mode;
+    heap->frame_sink = run_frame_sink;
+    o.configure(heap);
+    heap->keep_pauses = o.mmu_curve_file_name != 0;
+    if (o.trace_file_name) {
+        trace_open(o.trace_file_name, o.capacity());
+    }
+
+    o.start = std::chrono::steady_clock::now();
+    if (!o.bench) {
+        std::cout << "var frame_content = [\n";
+        log_start();
+    }
+    return heap;
+}
+
+// With --bench nothing is logged; a run prints one CSV row instead.
+// The columns are documented by bench.sh.
+
+void print_bench_row(const char *workload, Heap &h, double seconds, long work) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << workload << ',' << h.collector->name() << ',' << h.size << ",ok,"
+              << std::fixed << std::setprecision(3)
+              << seconds * 1000 << ',' << work << ',' << work / seconds << ','
+              << h.gc_count << ',' << h.gc_seconds * 1000 << ','
+              << h.max_pause_seconds * 1000 << ','
+              << h.max_live_words << ',' << usage.ru_maxrss << '\n';
+}
+
+// Minimum mutator utilization: for a window size w, the smallest
+// fraction of any w-long stretch of the run that was left to the
+// program. The worst stretches start at a pause start or end at a
+// pause end, so only those are tried. gc_before[i] is the GC time of
+// the pauses before pauses[i].
+
+double gc_until(const std::vector<Heap::Pause> &pauses, const std::vector<double> &gc_before, double t) {
+    int lo = 0;
+    int hi = pauses.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (pauses[mid].start < t) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return 0;
+    }
+    const Heap::Pause &last = pauses[lo - 1];
+    return gc_before[lo - 1] + std::min(t, last.end) - last.start;
+}
+
+double mmu(const std::vector<Heap::Pause> &pauses, const std::vector<double> &gc_before, double run, double w) {
+    double worst = 1;
+    for (int i = 0; i < (int)pauses.size(); ++i) {
+        double starts[2] = { pauses[i].start, pauses[i].end - w };
+        for (int j = 0; j < 2; ++j) {
+            double a = std::max(0.0, std::min(starts[j], run - w));
+            double gc = gc_until(pauses, gc_before, a + w) - gc_until(pauses, gc_before, a);
+            worst = std::min(worst, 1 - gc / w);
+        }
+    }
+    return std::max(worst, 0.0);
+}
+
+// Writes the MMU curve as CSV rows of window size in ms and MMU, for
+// windows from 1ms up to the length of the run.
+
+void write_mmu_curve(const char *file_name, Heap &h) {
+    std::chrono::duration<double> run = std::chrono::steady_clock::now() - h.born;
+    std::vector<double> gc_before;
+    double total = 0;
+    for (int i = 0; i < (int)h.pauses.size(); ++i) {
+        gc_before.push_back(total);
+        total += h.pauses[i].end - h.pauses[i].start;
+    }
+    std::ofstream out(file_name);
+    out << "window_ms,mmu\n";
+    const double steps[] = { 1, 2, 5 };
+    for (double decade = 0.001; decade < run.count(); decade *= 10) {
+        for (int i = 0; i < 3 && decade * steps[i] < run.count(); ++i) {
+            double w = decade * steps[i];
+            out << w * 1000 << ',' << std::fixed << std::setprecision(3)
+                << mmu(h.pauses, gc_before, run.count(), w) << '\n' << std::defaultfloat;
+        }
+    }
+}
+
+void finish_run(RunOptions &o, Heap *heap, const char *workload, long work) {
+    if (log_ready) {
+        trace_bin(OpStop);
+        log_stop();
+        std::cout << "['stop']];\n";
+    }
+    if (o.trace_file_name) {
+        bin_trace.close();
+    }
+    close_frame_sink();
+    heap->frame_sink = 0;
+
+    if (o.mmu_curve_file_name) {
+        write_mmu_curve(o.mmu_curve_file_name, *heap);
+    }
+    if (o.bench) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - o.start;
+        print_bench_row(workload, *heap, elapsed.count(), work);
+    }
+}
+
+// Other programs such as micro.cc include this file for the heap and
+// collectors and supply their own main.
+
+#ifndef DKP_NO_MAIN
+
+// --leaky keeps every intermediate result rooted until the end, like
+// the variables in reference/dkp-bad.rb, instead of dropping each one
+// before the next collection. --save-image writes the heap once the
+// log is parsed and --load-image starts from such an image instead of
+// parsing.
+
 int main(int argc, char **argv) {
-    const char *dkp_file_name = (argc == 2 && argv[1]) ? argv[1] : "data/dkp.log-small";
+    const char *dkp_file_name = "data/dkp.log-small";
+    RunOptions options;
+    bool leaky = false;
+    const char *save_image_name = 0;
+    const char *load_image_name = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (options.parse(argv[i])) {
+            continue;
+        }
+        else if (std::string(argv[i]) == "--leaky") {
+            leaky = true;
+        }
+        else if (strncmp(argv[i], "--save-image=", 13) == 0) {
+            save_image_name = argv[i] + 13;
+        }
+        else if (strncmp(argv[i], "--load-image=", 13) == 0) {
+            load_image_name = argv[i] + 13;
+        }
+        else {
+            dkp_file_name = argv[i];
+        }
+    }
 
     assert(Num::size_needed() == 2);
     assert(Str::size_needed("hello") == 7);
     assert(Tup::size_needed(5) == 7);
     assert(Vec::size_needed(5) == 3);
 
-    Mem::info[0].was_allocated();
-    Mem::top = 1; // heap[0] is nil
-
-    std::cout << "var frame_content = [\n";
-    log_start();
+    Heap *heap = start_run(options);
+    if (!heap) {
+        return 1;
+    }
 
-    VecRef *dkp_log = new VecRef();
+    VecRef *dkp_log;
     int bp = 0;
+    int lines = 0;
 
-    std::ifstream dkp_file;
-    dkp_file.open(dkp_file_name);
-    for (std::string data; std::getline(dkp_file, data); ) {
-        std::cout << "// line: " << data << '\n';
-        StrRef line(data);                 // allocate input line
-        VecRef field(line.split(','));     // split into Vec of Str
-        TupRef trans(3);                   // allocate 3 tuple
-        NumRef amt(field.get(0).to_i());   // convert field 1 to num
-        trans.set(0, amt);                 // trans[0] = Num
-        trans.set(1, field.get(1));        // trans[1] = Str
-        trans.set(2, field.get(2));        // trans[2] = Str
-        dkp_log->push(trans);
-        if (bp++ == 1) {
-            Mem::log_roots("line parsed");
+    if (load_image_name) {
+        std::vector<Loc> roots;
+        if (!heap->load_image(load_image_name, roots) || roots.size() != 1) {
+            std::cerr << "can't load heap image " << load_image_name << '\n';
+            return 1;
         }
-        if (bp % 5 == 0) {
-            Mem::gc();
+        dkp_log = new VecRef(ObjRef::adopt(roots[0]));
+        lines = dkp_log->length();
+    }
+    else {
+        dkp_log = new VecRef();
+        std::ifstream dkp_file;
+        dkp_file.open(dkp_file_name);
+        for (std::string data; std::getline(dkp_file, data); ) {
+            if (log_ready) {
+                std::cout << "// line: " << data << '\n';
+            }
+            StrRef line(data);                 // allocate input line
+            VecRef field(line.split(','));     // split into Vec of Str
+            TupRef trans(3);                   // allocate 3 tuple
+            NumRef amt(field.get(0).to_i());   // convert field 1 to num
+            trans.set(0, amt);                 // trans[0] = Num
+            trans.set(1, field.get(1));        // trans[1] = Str
+            trans.set(2, field.get(2));        // trans[2] = Str
+            dkp_log->push(trans);
+            lines += 1;
+            if (bp++ == 1) {
+                heap->log_roots("line parsed");
+            }
+            if (bp % 5 == 0) {
+                heap->gc();
+            }
         }
+        dkp_file.close();
+    }
+    if (save_image_name) {
+        heap->save_image(save_image_name);
     }
-    dkp_file.close();
 
-    Mem::log_roots("file parsed");
-    std::cout << "// "; dkp_log->dump(); std::cout << '\n';
+    heap->log_roots("file parsed");
+    if (log_ready) {
+        std::cout << "// "; dkp_log->dump(); std::cout << '\n';
+    }
 
     int dkp_log_length = dkp_log->length();
     VecRef *dkp_group = new VecRef();
@@ -1234,18 +4071,22 @@ int main(int argc, char **argv) {
                 }
             }
             if (bp++ == 1) {
-                Mem::log_roots("group found");
+                heap->log_roots("group found");
             }
         }
     }
 
-    delete dkp_log;
-    dkp_log = 0;
+    if (!leaky) {
+        delete dkp_log;
+        dkp_log = 0;
+    }
 
-    Mem::gc();
+    heap->gc();
 
-    Mem::log_roots("data grouped");
-    std::cout << "// "; dkp_group->dump(); std::cout << '\n';
+    heap->log_roots("data grouped");
+    if (log_ready) {
+        std::cout << "// "; dkp_group->dump(); std::cout << '\n';
+    }
     bp = 0;
 
     int dkp_group_length = dkp_group->length();
@@ -1265,14 +4106,16 @@ int main(int argc, char **argv) {
         person.set(1, final);
         dkp_standing->push(person);
         if (bp++ == 1) {
-            Mem::log_roots("transaction history reduced");
+            heap->log_roots("transaction history reduced");
         }
     }
 
-    delete dkp_group;
-    dkp_group = 0;
+    if (!leaky) {
+        delete dkp_group;
+        dkp_group = 0;
+    }
 
-    Mem::gc();
+    heap->gc();
 
     int dkp_standing_length = dkp_standing->length();
     VecRef *dkp_rank = new VecRef(dkp_standing_length);
@@ -1286,18 +4129,26 @@ int main(int argc, char **argv) {
         }
     }
 
-    delete dkp_standing;
-    dkp_standing = 0;
+    if (!leaky) {
+        delete dkp_standing;
+        dkp_standing = 0;
+    }
 
-    Mem::gc();
+    heap->gc();
 
-    Mem::log_roots("ranking finished");
-    std::cout << "// "; dkp_rank->dump(); std::cout << '\n';
-    log_stop();
-    std::cout << "['stop']];\n";
+    heap->log_roots("ranking finished");
+    if (log_ready) {
+        std::cout << "// "; dkp_rank->dump(); std::cout << '\n';
+    }
+    finish_run(options, heap, leaky ? "dkp_leaky" : "dkp", lines);
 
     delete dkp_rank;
     dkp_rank = 0;
+    delete dkp_standing;
+    delete dkp_group;
+    delete dkp_log;
 
     return 0;
 }
+
+#endif
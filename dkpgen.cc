@@ -0,0 +1,208 @@
+/*
+ * Writes synthetic DKP logs in the same amount,person,item format as
+ * data/dkp.log-big so the collectors can be run on inputs of any
+ * size. The output only depends on the options, so a seed and a set
+ * of options always reproduce the same log.
+ *
+ *   ./dkpgen.exe --lines=1000000 --people=500 > data/dkp.log-1m
+ *
+ * People are picked with Zipfian popularity: the k-th most popular
+ * person shows up in proportion to 1/k^zipf. Item names are built
+ * from syllables with a geometric length distribution, and amounts
+ * are uniform over the --amount range.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+
+// splitmix64, so the log is the same with every compiler and library.
+
+static uint64_t rng_state;
+
+uint64_t next_random() {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double next_double() {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+long next_between(long min, long max) {
+    return min + (long)(next_random() % (uint64_t)(max - min + 1));
+}
+
+static const char *Crew[] = {
+    "Mal", "Wash", "Zoe", "Jayne", "Kaylee", "Shepherd", "Simon", "River", "Inara"
+};
+const int CrewSize = sizeof(Crew) / sizeof(Crew[0]);
+
+static const char *Syllables[] = {
+    "ka", "ri", "to", "ne", "su", "la", "mo", "de",
+    "vi", "ga", "ho", "ze", "pu", "ta", "mi", "ro"
+};
+const int SyllableCount = sizeof(Syllables) / sizeof(Syllables[0]);
+
+// Names after the crew spell their index in syllables, so they are
+// all different.
+
+std::string person_name(int i) {
+    if (i < CrewSize) {
+        return Crew[i];
+    }
+    std::string name;
+    for (i -= CrewSize; ; i /= SyllableCount) {
+        name += Syllables[i % SyllableCount];
+        if (i < SyllableCount) {
+            break;
+        }
+    }
+    name[0] = toupper(name[0]);
+    return name;
+}
+
+// A word of one to three syllables, capitalized.
+
+std::string item_word() {
+    std::string word;
+    int n = next_between(1, 3);
+    for (int i = 0; i < n; ++i) {
+        word += Syllables[next_random() % SyllableCount];
+    }
+    word[0] = toupper(word[0]);
+    return word;
+}
+
+// Item names grow a word at a time until they reach a length drawn
+// from a geometric distribution with the given mean, capped at max.
+
+std::string item_name(int mean_len, int max_len) {
+    int len = 1;
+    double p = 1.0 / mean_len;
+    while (len < max_len && next_double() > p) {
+        ++len;
+    }
+    std::string name = item_word();
+    while ((int)name.size() < len) {
+        name += ' ';
+        name += item_word();
+    }
+    if ((int)name.size() > max_len) {
+        name.resize(max_len);
+    }
+    if (name[name.size() - 1] == ' ') {
+        name.resize(name.size() - 1);
+    }
+    return name;
+}
+
+void usage() {
+    std::cerr << "usage: dkpgen.exe [--lines=N] [--people=N] [--zipf=S]"
+                 " [--item-len=MEAN] [--item-max=MAX] [--items=N]"
+                 " [--amount=MIN:MAX] [--seed=N]\n";
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    long long lines = 1000;
+    int people = 100;
+    double zipf = 1.0;
+    int item_len = 12;
+    int item_max = 40;
+    int items = 200;
+    long amount_min = -10;
+    long amount_max = 10;
+    uint64_t seed = 20140801;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--lines=", 8) == 0) {
+            lines = atoll(arg + 8);
+        }
+        else if (strncmp(arg, "--people=", 9) == 0) {
+            people = atoi(arg + 9);
+        }
+        else if (strncmp(arg, "--zipf=", 7) == 0) {
+            zipf = atof(arg + 7);
+        }
+        else if (strncmp(arg, "--item-len=", 11) == 0) {
+            item_len = atoi(arg + 11);
+        }
+        else if (strncmp(arg, "--item-max=", 11) == 0) {
+            item_max = atoi(arg + 11);
+        }
+        else if (strncmp(arg, "--items=", 8) == 0) {
+            items = atoi(arg + 8);
+        }
+        else if (strncmp(arg, "--amount=", 9) == 0) {
+            if (sscanf(arg + 9, "%ld:%ld", &amount_min, &amount_max) != 2) {
+                usage();
+            }
+        }
+        else if (strncmp(arg, "--seed=", 7) == 0) {
+            seed = strtoull(arg + 7, 0, 10);
+        }
+        else {
+            usage();
+        }
+    }
+    if (lines < 0 || people < 1 || items < 1 || item_len < 1 ||
+        item_max < item_len || amount_min > amount_max) {
+        usage();
+    }
+    rng_state = seed;
+
+    std::vector<std::string> names;
+    std::vector<double> popularity; // cumulative, for a binary search
+    double total = 0;
+    for (int i = 0; i < people; ++i) {
+        names.push_back(person_name(i));
+        total += 1.0 / pow(i + 1, zipf);
+        popularity.push_back(total);
+    }
+
+    // Items come from a fixed table so they repeat the way they do
+    // in a real log.
+    std::vector<std::string> item_names;
+    for (int i = 0; i < items; ++i) {
+        item_names.push_back(item_name(item_len, item_max));
+    }
+
+    // Lines are formatted into a big buffer; a billion line log
+    // spends its time in the generator, not in stdio.
+    std::vector<char> out(1 << 20);
+    size_t used = 0;
+    char line[128];
+    for (long long n = 0; n < lines; ++n) {
+        double pick = next_double() * total;
+        int person = std::upper_bound(popularity.begin(), popularity.end(), pick) - popularity.begin();
+        if (person >= people) {
+            person = people - 1;
+        }
+        long amount = next_between(amount_min, amount_max);
+        const std::string &item = item_names[next_random() % items];
+        int len = snprintf(line, sizeof(line), "%ld,%s,%s\n",
+                           amount, names[person].c_str(), item.c_str());
+        if (len >= (int)sizeof(line)) {
+            len = sizeof(line) - 1;
+            line[len - 1] = '\n';
+        }
+        if (used + len > out.size()) {
+            fwrite(&out[0], 1, used, stdout);
+            used = 0;
+        }
+        memcpy(&out[used], line, len);
+        used += len;
+    }
+    fwrite(&out[0], 1, used, stdout);
+    return 0;
+}
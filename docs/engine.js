@@ -88,9 +88,56 @@ function drawGuides() {
   }
 }
 
-var mem_content = [
- ":nil"
-];
+// Word contents live in typed arrays: mem_kind says how a word is
+// drawn and mem_value holds its char code, number, address or label.
+
+var WORD_EMPTY = 0;
+var WORD_CHAR = 1;
+var WORD_NUM = 2;
+var WORD_REF = 3;
+var WORD_LABEL = 4;
+
+// Same order as Obj::TypeName in dkp.cc.
+var labels = ["nil ", "* ", "- ", "n ", "<> ", "[] ", "s "];
+var char_labels = [];
+
+var mem_size = memory_width * Math.floor(memory_canvas.height / word_height);
+var mem_kind = new Uint8Array(mem_size);
+var mem_value = new Int32Array(mem_size);
+
+mem_kind[0] = WORD_LABEL;
+mem_value[0] = 0;
+
+function resizeMemory(size) {
+  if (size > mem_size) {
+    var kind = new Uint8Array(size);
+    var value = new Int32Array(size);
+    kind.set(mem_kind);
+    value.set(mem_value);
+    mem_kind = kind;
+    mem_value = value;
+    mem_size = size;
+  }
+}
+
+function labelIndex(label) {
+  for (var i = 0; i < labels.length; ++i) {
+    if (labels[i] == label) {
+      return i;
+    }
+  }
+  labels.push(label);
+  return labels.length - 1;
+}
+
+function charLabel(code) {
+  var label = char_labels[code];
+  if (label === undefined) {
+    label = String.fromCharCode(code);
+    char_labels[code] = label;
+  }
+  return label;
+}
 
 function drawWord(addr) {
   var p = addressToPoint(addr);
@@ -100,23 +147,24 @@ function drawWord(addr) {
   memory_ctx.fillStyle = "#222222";
   memory_ctx.fillRect(x, y, word_width - 1, word_height - 1);
 
-  var cell = mem_content[addr].toString();
-  if (cell) {
-    if (cell.charAt(0) == "'") {
+  var kind = mem_kind[addr];
+  if (kind != WORD_EMPTY) {
+    var cell;
+    if (kind == WORD_CHAR) {
       memory_ctx.fillStyle = "#00ff00";
-      cell = cell.substring(1);
+      cell = charLabel(mem_value[addr]);
     }
-    else if (cell.charAt(0) == "=") {
+    else if (kind == WORD_NUM) {
       memory_ctx.fillStyle = "#00ff00";
-      cell = cell.substring(1);
+      cell = mem_value[addr].toString();
     }
-    else if (cell.charAt(0) == ":") {
+    else if (kind == WORD_LABEL) {
       memory_ctx.fillStyle = "#ffffff";
-      cell = cell.substring(1);
+      cell = labels[mem_value[addr]];
     }
     else {
       memory_ctx.fillStyle = "#ffff00";
-      var c = addressToPoint(mem_content[addr]);
+      var c = addressToPoint(mem_value[addr]);
       cell = c[1].toString() + "." + c[0];
     }
 
@@ -171,12 +219,12 @@ function copyWords(to_addr, from_addr, count, subframe) {
   }
 }
 
-function blinkWords(list, subframe, color) {
+function blinkWords(subframe, color) {
   if (subframe < 100 && subframe % 20 != 0) {
     animation_ctx.strokeStyle = color;
 
-    for (var i = 1; i < list.length; ++i) {
-      var p = addressToPoint(list[i]);
+    for (var i = 0; i < op_b; ++i) {
+      var p = addressToPoint(listItem(i));
       var x = p[0] * word_width;
       var y = p[1] * word_height;
 
@@ -210,17 +258,16 @@ function draw_connection(event) {
 
   drawing_ctx.clearRect(0, 0, drawing_canvas.width, drawing_canvas.height);
 
-  if (mem_content[addr]) {
+  if (mem_kind[addr] != WORD_EMPTY) {
     drawing_ctx.lineWidth = 3;
     drawing_ctx.strokeStyle = "#ffffff";
     drawing_ctx.strokeRect(x, y, word_width + 1, word_height + 1);
 
-    var cell = mem_content[addr].toString();
     var to_x;
     var to_y;
 
-    if (cell.charAt(0) >= '0' && cell.charAt(0) <= '9') {
-      var p = addressToPoint(mem_content[addr]);
+    if (mem_kind[addr] == WORD_REF) {
+      var p = addressToPoint(mem_value[addr]);
       to_x = p[0] * word_width;
       to_y = p[1] * word_height;
     }
@@ -248,10 +295,215 @@ var requestAnimationFrame = (function() {
          };
 })();
 
+// Frames come either from the frame_content array in frames.js or
+// from a binary trace written by "dkp.exe --trace=FILE". Both are
+// decoded into the op registers below so that dispatch is the same
+// and allocates nothing per frame.
+
+var OP_UNKNOWN = 0;
+var OP_ALLOC = 1;
+var OP_FREE = 2;
+var OP_INIT = 3;
+var OP_REF_COUNT = 4;
+var OP_SET_CHAR = 5;
+var OP_SET_NUM = 6;
+var OP_SET_REF = 7;
+var OP_COPY = 8;
+var OP_BP = 9;
+var OP_ROOTS = 10;
+var OP_LIVE = 11;
+var OP_STOP = 12;
+
+// Decoded set ops all become OP_SET with the word kind in op_b.
+var OP_SET = OP_SET_CHAR;
+
+var text_ops = {
+  'alloc': OP_ALLOC, 'free': OP_FREE, 'init': OP_INIT,
+  'ref_count': OP_REF_COUNT, 'set': OP_SET, 'box': OP_SET,
+  'copy': OP_COPY, 'bp': OP_BP, 'roots': OP_ROOTS, 'live': OP_LIVE,
+  'stop': OP_STOP
+};
+
+var op = OP_UNKNOWN;
+var op_a = 0;
+var op_b = 0;
+var op_c = 0;
+
+var trace = null;
+var trace_start = 0;
+var trace_pos = 0;
+var trace_next = 0;
+
+function decodeCell(cell) {
+  if (typeof cell == 'number') {
+    op_b = WORD_REF;
+    op_c = cell;
+  }
+  else if (cell == "") {
+    op_b = WORD_EMPTY;
+    op_c = 0;
+  }
+  else if (cell.charAt(0) == "'") {
+    op_b = WORD_CHAR;
+    op_c = cell.charCodeAt(1);
+  }
+  else if (cell.charAt(0) == "=") {
+    op_b = WORD_NUM;
+    op_c = parseInt(cell.substring(1), 10);
+  }
+  else if (cell.charAt(0) == ":") {
+    op_b = WORD_LABEL;
+    op_c = labelIndex(cell.substring(1));
+  }
+  else {
+    op_b = WORD_REF;
+    op_c = parseInt(cell, 10);
+  }
+}
+
+function decodeText() {
+  var content = frame_content[frame];
+  op = text_ops[content[0]] || OP_UNKNOWN;
+  if (op == OP_SET) {
+    op_a = content[1];
+    decodeCell(content[2]);
+  }
+  else if (op == OP_ROOTS || op == OP_LIVE) {
+    op_a = 1;
+    op_b = content.length - 1;
+  }
+  else {
+    op_a = content[1];
+    op_b = content[2];
+    op_c = content[3];
+  }
+}
+
+// Decodes the record at pos and returns the position of the next one.
+
+function decodeBinary(pos) {
+  op = trace.getUint8(pos);
+  pos += 1;
+  switch (op) {
+    case OP_ALLOC:
+    case OP_FREE:
+    case OP_INIT:
+    case OP_REF_COUNT:
+      op_a = trace.getUint16(pos, true);
+      op_b = trace.getUint16(pos + 2, true);
+      return pos + 4;
+    case OP_SET_CHAR:
+    case OP_SET_REF:
+      op_b = (op == OP_SET_CHAR) ? WORD_CHAR : WORD_REF;
+      op = OP_SET;
+      op_a = trace.getUint16(pos, true);
+      op_c = trace.getUint16(pos + 2, true);
+      return pos + 4;
+    case OP_SET_NUM:
+      op = OP_SET;
+      op_a = trace.getUint16(pos, true);
+      op_b = WORD_NUM;
+      op_c = trace.getInt16(pos + 2, true);
+      return pos + 4;
+    case OP_COPY:
+      op_a = trace.getUint16(pos, true);
+      op_b = trace.getUint16(pos + 2, true);
+      op_c = trace.getUint16(pos + 4, true);
+      return pos + 6;
+    case OP_BP:
+      op_a = pos + 2;
+      op_b = trace.getUint16(pos, true);
+      return op_a + op_b;
+    case OP_ROOTS:
+    case OP_LIVE:
+      op_a = pos + 2;
+      op_b = trace.getUint16(pos, true);
+      return op_a + 2 * op_b;
+    case OP_STOP:
+      return pos;
+    default:
+      throw new Error("bad trace opcode " + op + " at " + (pos - 1));
+  }
+}
+
+function decodeFrame() {
+  if (trace) {
+    trace_next = decodeBinary(trace_pos);
+  }
+  else {
+    decodeText();
+  }
+}
+
+function nextFrame() {
+  ++frame;
+  trace_pos = trace_next;
+}
+
+function listItem(i) {
+  if (trace) {
+    return trace.getUint16(op_a + 2 * i, true);
+  }
+  return frame_content[frame][op_a + i];
+}
+
+function bpMessage() {
+  if (trace) {
+    var msg = "";
+    for (var i = 0; i < op_b; ++i) {
+      msg += String.fromCharCode(trace.getUint8(op_a + i));
+    }
+    return msg;
+  }
+  return frame_content[frame][1];
+}
+
+function useTrace(buffer) {
+  var view = new DataView(buffer);
+  if (view.getUint8(0) != 0x47 || view.getUint8(1) != 0x43 ||
+      view.getUint8(2) != 0x56 || view.getUint8(3) != 0x5a) {
+    throw new Error("not a GCVZ trace");
+  }
+  resizeMemory(view.getUint16(6, true));
+
+  // count the frames with one pass over the bytes
+  trace = view;
+  trace_start = 8;
+  frame_count = 0;
+  for (var pos = trace_start; pos < buffer.byteLength; ++frame_count) {
+    pos = decodeBinary(pos);
+  }
+  trace_pos = trace_start;
+  op = OP_UNKNOWN;
+}
+
+function loadTrace(url) {
+  var request = new XMLHttpRequest();
+  request.open('GET', url, true);
+  request.responseType = 'arraybuffer';
+  request.onload = function() {
+    useTrace(request.response);
+  };
+  request.send();
+}
+
 var animation_running = false;
 var frame = 0;
 var subframe = 0;
-var frame_count = frame_content.length;
+var frame_count = 0;
+
+(function() {
+  var match = /[?&]trace=([^&]*)/.exec(window.location.search);
+  if (match) {
+    loadTrace(decodeURIComponent(match[1]));
+  }
+  else if (typeof frame_content == 'undefined') {
+    loadTrace('frames.bin');
+  }
+  else {
+    frame_count = frame_content.length;
+  }
+})();
 
 function toggle_animation() {
   var button = document.getElementById('run_button');
@@ -278,6 +530,7 @@ function pause_animation(message) {
 function stop_animation() {
   var button = document.getElementById('run_button');
   frame = 0;
+  trace_pos = trace_start;
   animation_running = false;
   button.innerHTML = "Start";
   var status = document.getElementById('run_status');
@@ -292,71 +545,71 @@ function animate(timestamp) {
     animation_ctx.clearRect(0, 0, animation_canvas.width, animation_canvas.height);
 
     if (subframe == 0) {
-      if (frame_content[frame][0] == 'box') {
-        mem_content[frame_content[frame][1]] = frame_content[frame][2];
-        drawWord(frame_content[frame][1]);
-      }
-      else if (frame_content[frame][0] == 'set') {
-        mem_content[frame_content[frame][1]] = frame_content[frame][2];
-        drawWord(frame_content[frame][1]);
+      decodeFrame();
+      if (op == OP_SET) {
+        mem_kind[op_a] = op_b;
+        mem_value[op_a] = op_c;
+        drawWord(op_a);
       }
-      else if (frame_content[frame][0] == 'alloc') {
-        for (var i = 0; i < frame_content[frame][2]; ++i) {
-          mem_content[frame_content[frame][1] + i] = "";
-          drawWord(frame_content[frame][1] + i);
+      else if (op == OP_ALLOC) {
+        for (var i = 0; i < op_b; ++i) {
+          mem_kind[op_a + i] = WORD_EMPTY;
+          drawWord(op_a + i);
         }
       }
-      else if (frame_content[frame][0] == 'free') {
-        for (var i = 0; i < frame_content[frame][2]; ++i) {
-          mem_content[frame_content[frame][1] + i] = "";
-          clearWord(frame_content[frame][1] + i);
+      else if (op == OP_FREE) {
+        for (var i = 0; i < op_b; ++i) {
+          mem_kind[op_a + i] = WORD_EMPTY;
+          clearWord(op_a + i);
         }
       }
-      else if (frame_content[frame][0] == 'ref_count') {
+      else if (op == OP_REF_COUNT) {
       }
-      else if (frame_content[frame][0] == 'bp') {
+      else if (op == OP_BP) {
         var bp_msg = document.getElementById('bp_msg');
-        bp_msg.innerHTML = frame_content[frame][1];
+        bp_msg.innerHTML = bpMessage();
       }
-      else if (frame_content[frame][0] == 'roots') {
-        blinkWords(frame_content[frame], 1, "#ff0000");
+      else if (op == OP_ROOTS) {
+        blinkWords(1, "#ff0000");
         pause_animation("root set");
       }
-      else if (frame_content[frame][0] == 'live') {
-        blinkWords(frame_content[frame], 1, "#ff0000");
+      else if (op == OP_LIVE) {
+        blinkWords(1, "#ff0000");
         pause_animation("live set");
       }
-      else if (frame_content[frame][0] == 'stop') {
+      else if (op == OP_STOP) {
         stop_animation();
+        return;
       }
       else {
         // begin a subframe animation
         subframe += 10;
-        if (frame_content[frame][0] == 'copy') {
-          for (var i = 0; i < frame_content[frame][3]; ++i) {
-            mem_content[frame_content[frame][1] + i] = mem_content[frame_content[frame][2] + i];
+        if (op == OP_COPY) {
+          for (var i = 0; i < op_c; ++i) {
+            mem_kind[op_a + i] = mem_kind[op_b + i];
+            mem_value[op_a + i] = mem_value[op_b + i];
           }
-          copyWords(frame_content[frame][1], frame_content[frame][2], frame_content[frame][3], subframe);
+          copyWords(op_a, op_b, op_c, subframe);
         }
       }
       if (subframe == 0) {
-        ++frame;
+        nextFrame();
       }
     }
     else {
       subframe += 10;
-      if (frame_content[frame][0] == 'copy') {
-        copyWords(frame_content[frame][1], frame_content[frame][2], frame_content[frame][3], subframe);
+      if (op == OP_COPY) {
+        copyWords(op_a, op_b, op_c, subframe);
       }
-      else if (frame_content[frame][0] == 'roots') {
-        blinkWords(frame_content[frame], subframe, "#ff0000");
+      else if (op == OP_ROOTS) {
+        blinkWords(subframe, "#ff0000");
       }
-      else if (frame_content[frame][0] == 'live') {
-        blinkWords(frame_content[frame], subframe, "#ff0000");
+      else if (op == OP_LIVE) {
+        blinkWords(subframe, "#ff0000");
       }
       if (subframe >= 100) {
         subframe = 0;
-        ++frame;
+        nextFrame();
       }
     }
   }
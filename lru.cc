@@ -0,0 +1,148 @@
+/*
+ * An LRU cache churn workload. A long-lived set-associative cache
+ * keeps getting new values stored into its old entries, which makes
+ * a steady stream of old-to-young pointers and medium-lived garbage:
+ * the worst case for generational write barriers and for mark-sweep
+ * fragmentation.
+ *
+ * The cache is a Vec of entries, each a 2-tuple of key and value,
+ * where each set of entries is kept in recency order. Keys are Nums
+ * drawn with a skew toward small keys. A miss stores a new entry over
+ * the least recently used one of its set, and a quarter of the hits
+ * store a new value into the old entry. Values alternate between a
+ * Str of random length and a Tup holding a Num and a Str.
+ *
+ * It takes the same collector, heap, frame and --bench options as
+ * dkp.exe, plus:
+ *
+ *   --ops=N     number of lookups (default 2000)
+ *   --sets=N    number of cache sets (default 16)
+ *   --ways=N    entries per set (default 4)
+ *   --keys=N    size of the key space (default 256)
+ *   --seed=N    random seed (default 1)
+ */
+
+#define DKP_NO_MAIN
+#include "dkp.cc"
+
+static unsigned int seed = 1;
+
+int random_below(int n) {
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 8) & 0xffffff) % n;
+}
+
+// Half the time the value is a Str, otherwise a Tup of a Num and a
+// shorter Str, so the garbage has a mix of sizes.
+
+ObjRef new_value(int key, int n) {
+    std::string data(4 + random_below(20), 'a' + key % 26);
+    if (n % 2 == 0) {
+        return StrRef(data);
+    }
+    TupRef pair(2);
+    pair.set(0, NumRef(key));
+    pair.set(1, StrRef(data.substr(0, data.size() / 2)));
+    return pair;
+}
+
+int main(int argc, char **argv) {
+    RunOptions options;
+    options.heap_size = 8000;
+    long ops = 2000;
+    int sets = 16;
+    int ways = 4;
+    int keys = 256;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (options.parse(argv[i])) {
+            continue;
+        }
+        else if (arg.compare(0, 6, "--ops=") == 0) {
+            ops = atol(argv[i] + 6);
+        }
+        else if (arg.compare(0, 7, "--sets=") == 0) {
+            sets = atoi(argv[i] + 7);
+        }
+        else if (arg.compare(0, 7, "--ways=") == 0) {
+            ways = atoi(argv[i] + 7);
+        }
+        else if (arg.compare(0, 7, "--keys=") == 0) {
+            keys = atoi(argv[i] + 7);
+        }
+        else if (arg.compare(0, 7, "--seed=") == 0) {
+            seed = atoi(argv[i] + 7);
+        }
+        else {
+            std::cerr << "unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+    if (ops < 0 || sets < 1 || ways < 1 || keys < 1) {
+        std::cerr << "need positive sets, ways and keys\n";
+        return 1;
+    }
+
+    Heap *heap = start_run(options);
+    if (!heap) {
+        return 1;
+    }
+
+    // Each set is kept in recency order, most recent first. Every
+    // entry starts out empty with a nil key.
+    VecRef cache(sets * ways);
+    for (int i = 0; i < sets * ways; ++i) {
+        TupRef entry(2);
+        cache.push(entry);
+    }
+    heap->log_roots("cache built");
+
+    long hits = 0;
+    for (long n = 0; n < ops; ++n) {
+        // a draw below a uniform draw, so key k comes up with odds
+        // of about ln(keys / k) / keys, which favors small keys
+        int key = random_below(random_below(keys) + 1);
+        int first = (key % sets) * ways;
+        int way = 0;
+        while (way < ways - 1) {
+            ObjRef k = cache.get(first + way, 0);
+            if (k.type() == Obj::TNum && k.to_i() == key) {
+                break;
+            }
+            ++way;
+        }
+        TupRef entry(cache.get(first + way));
+        ObjRef k = entry.get(0);
+        if (k.type() == Obj::TNum && k.to_i() == key) {
+            // a hit sometimes refreshes the value in place
+            hits += 1;
+            if (random_below(4) == 0) {
+                entry.set(1, new_value(key, n));
+            }
+        }
+        else {
+            // a miss evicts the last entry of the set
+            TupRef fresh(2);
+            fresh.set(0, NumRef(key));
+            fresh.set(1, new_value(key, n));
+            cache.set(first + way, fresh);
+        }
+        ObjRef used = cache.get(first + way);
+        for (int w = way; w > 0; --w) {
+            cache.set(first + w, cache.get(first + w - 1));
+        }
+        cache.set(first, used);
+        if (n == ops / 2) {
+            heap->log_roots("cache warm");
+        }
+    }
+
+    heap->log_roots("churn finished");
+    if (log_ready) {
+        std::cout << "// " << hits << " hits in " << ops << " lookups\n";
+    }
+
+    finish_run(options, heap, "lru", ops);
+    return 0;
+}
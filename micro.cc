@@ -0,0 +1,283 @@
+/*
+ * Microbenchmarks for the allocator and collector primitives.
+ *
+ * Each benchmark builds a fresh heap, then times one pass of a single
+ * primitive over it. Graphs are built from raw locs without Ref
+ * classes so the setup doesn't add thousands of roots, which is only
+ * safe because none of the collectors used here count references and
+ * the heaps are big enough that setup never collects.
+ *
+ * Output is CSV: benchmark, param, ops per pass, then the min and
+ * median ns/op over the timed passes.
+ */
+
+#define DKP_NO_MAIN
+#include "dkp.cc"
+
+#include <algorithm>
+
+int warmup = 3;
+int iterations = 20;
+
+// Benchmarks time their own hot loop so that setup is left out.
+
+static std::chrono::steady_clock::time_point timer_start;
+static double timed_seconds;
+
+void start_timer() {
+    timer_start = std::chrono::steady_clock::now();
+}
+
+void stop_timer() {
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - timer_start;
+    timed_seconds += t.count();
+}
+
+typedef long (*BenchFn)(Heap &h, int param);
+
+void run(const char *name, const char *gc_name, int param, BenchFn bench) {
+    std::vector<double> ns_per_op;
+    long ops = 0;
+    for (int i = 0; i < warmup + iterations; ++i) {
+        Collector *collector = Collector::named(gc_name);
+        Heap *h = new Heap(collector, MaxHeapSize);
+        Heap::current = h;
+        timed_seconds = 0;
+        ops = bench(*h, param);
+        delete h;
+        delete collector;
+        if (i >= warmup) {
+            ns_per_op.push_back(timed_seconds * 1e9 / ops);
+        }
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    std::cout << name << ',' << param << ',' << ops << ','
+              << std::fixed << std::setprecision(2)
+              << ns_per_op[0] << ',' << ns_per_op[ns_per_op.size() / 2] << '\n';
+}
+
+// Fixed seed so every run builds the same graphs.
+
+static unsigned int seed;
+
+unsigned int next_random() {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) & 0xffffff;
+}
+
+Loc new_num(Heap &h, SWd val) {
+    Loc loc = h.alloc(Num::size_needed());
+    ((Num *)Obj::at(loc))->init(val);
+    return loc;
+}
+
+Loc new_tup(Heap &h, int len) {
+    Loc loc = h.alloc(Tup::size_needed(len));
+    Tup::at(loc)->init(len);
+    return loc;
+}
+
+// Every param-th percent of count objects is true, spread evenly.
+
+bool picked(int i, int percent) {
+    return (i * percent) / 100 != ((i + 1) * percent) / 100;
+}
+
+// Lays out count Nums and roots the picked ones through one Tup at
+// the end of the heap.
+
+ObjRef *nums_with_live_percent(Heap &h, int count, int percent) {
+    std::vector<Loc> live;
+    for (int i = 0; i < count; ++i) {
+        Loc loc = new_num(h, i);
+        if (picked(i, percent)) {
+            live.push_back(loc);
+        }
+    }
+    Loc holder = new_tup(h, live.size());
+    for (int i = 0; i < (int)live.size(); ++i) {
+        Tup::at(holder)->val[i] = live[i];
+    }
+    return new ObjRef(ObjRef::at(holder));
+}
+
+long bench_alloc(Heap &h, int size) {
+    long ops = 0;
+    start_timer();
+    while (h.top + size < h.size) {
+        h.alloc(size);
+        ++ops;
+    }
+    stop_timer();
+    return ops;
+}
+
+// Frees every other block, then the rest, so half of the frees
+// coalesce with both neighbours.
+
+long bench_free(Heap &h, int size) {
+    std::vector<Loc> locs;
+    while (h.top + size < h.size) {
+        locs.push_back(h.alloc(size));
+    }
+    start_timer();
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = pass; i < (int)locs.size(); i += 2) {
+            h.free(locs[i], size);
+        }
+    }
+    stop_timer();
+    return locs.size();
+}
+
+long bench_mark_list(Heap &h, int length) {
+    Loc head = 0;
+    for (int i = 0; i < length; ++i) {
+        Loc node = new_tup(h, 1);
+        Tup::at(node)->val[0] = head;
+        head = node;
+    }
+    ObjRef root = ObjRef::at(head);
+    start_timer();
+    h.mark_live<MarkSweepGC>();
+    stop_timer();
+    return h.live.size();
+}
+
+Loc build_tree(Heap &h, int fanout, int depth) {
+    if (depth == 0) {
+        return new_num(h, depth);
+    }
+    Loc node = new_tup(h, fanout);
+    for (int i = 0; i < fanout; ++i) {
+        Loc child = build_tree(h, fanout, depth - 1);
+        Tup::at(node)->val[i] = child;
+    }
+    return node;
+}
+
+// About 4000 leaves whatever the fanout.
+
+long bench_mark_tree(Heap &h, int fanout) {
+    int depth = 0;
+    for (int leaves = 1; leaves * fanout <= 4096; leaves *= fanout) {
+        ++depth;
+    }
+    ObjRef root = ObjRef::at(build_tree(h, fanout, depth));
+    start_timer();
+    h.mark_live<MarkSweepGC>();
+    stop_timer();
+    return h.live.size();
+}
+
+// Layers of 64 nodes where each node points at two random nodes in
+// the next layer. Tracing doesn't skip marked objects, so the time
+// per object grows with depth.
+
+long bench_mark_dag(Heap &h, int depth) {
+    const int width = 64;
+    seed = 1;
+    std::vector<Loc> below;
+    for (int i = 0; i < width; ++i) {
+        below.push_back(new_num(h, i));
+    }
+    for (int d = 0; d < depth; ++d) {
+        std::vector<Loc> layer;
+        for (int i = 0; i < width; ++i) {
+            Loc node = new_tup(h, 2);
+            Tup::at(node)->val[0] = below[next_random() % width];
+            Tup::at(node)->val[1] = below[next_random() % width];
+            layer.push_back(node);
+        }
+        below = layer;
+    }
+    Loc top_node = new_tup(h, width);
+    for (int i = 0; i < width; ++i) {
+        Tup::at(top_node)->val[i] = below[i];
+    }
+    ObjRef root = ObjRef::at(top_node);
+    start_timer();
+    h.mark_live<MarkSweepGC>();
+    stop_timer();
+    return h.live.size();
+}
+
+long bench_sweep(Heap &h, int live_percent) {
+    const int count = 15000;
+    ObjRef *root = nums_with_live_percent(h, count, live_percent);
+    h.mark_live<MarkSweepGC>();
+    start_timer();
+    h.sweep_garbage();
+    stop_timer();
+    delete root;
+    return count;
+}
+
+long bench_compact(Heap &h, int garbage_percent) {
+    const int count = 15000;
+    ObjRef *root = nums_with_live_percent(h, count, 100 - garbage_percent);
+    start_timer();
+    h.compact_live<MarkCompactGC>();
+    stop_timer();
+    h.fixup_references<MarkCompactGC>();
+    delete root;
+    return count;
+}
+
+long bench_move(Heap &h, int live_percent) {
+    const int count = 8000;
+    ObjRef *root = nums_with_live_percent(h, count, live_percent);
+    start_timer();
+    h.move_live<CopyGC>();
+    stop_timer();
+    long moved = h.live.size();
+    h.fixup_references<CopyGC>();
+    delete root;
+    return moved;
+}
+
+int main(int argc, char **argv) {
+    std::string only;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, 9, "--warmup=") == 0) {
+            warmup = atoi(argv[i] + 9);
+        }
+        else if (arg.compare(0, 13, "--iterations=") == 0) {
+            iterations = atoi(argv[i] + 13);
+        }
+        else {
+            only = arg;
+        }
+    }
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    struct {
+        const char *name;
+        const char *gc_name;
+        BenchFn bench;
+        int params[6]; // 0 terminated
+    } benches[] = {
+        { "alloc", "MARK_SWEEP_GC", bench_alloc, { 2, 4, 16, 64, 0 } },
+        { "free", "MARK_SWEEP_GC", bench_free, { 2, 4, 16, 64, 0 } },
+        { "mark_list", "MARK_SWEEP_GC", bench_mark_list, { 100, 1000, 10000, 0 } },
+        { "mark_tree", "MARK_SWEEP_GC", bench_mark_tree, { 2, 16, 64, 0 } },
+        { "mark_dag", "MARK_SWEEP_GC", bench_mark_dag, { 2, 4, 8, 0 } },
+        { "sweep_garbage", "MARK_SWEEP_GC", bench_sweep, { 1, 10, 50, 90, 100, 0 } },
+        { "compact_live", "MARK_COMPACT_GC", bench_compact, { 1, 10, 50, 90, 0 } },
+        { "move_live", "COPY_GC", bench_move, { 1, 10, 50, 90, 100, 0 } },
+    };
+
+    std::cout << "benchmark,param,ops,min_ns_per_op,median_ns_per_op\n";
+    for (int b = 0; b < (int)(sizeof(benches) / sizeof(benches[0])); ++b) {
+        if (!only.empty() && only != benches[b].name) {
+            continue;
+        }
+        for (int p = 0; benches[b].params[p]; ++p) {
+            run(benches[b].name, benches[b].gc_name, benches[b].params[p], benches[b].bench);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * A sharded version of the dkp program. The log is split into byte
+ * ranges, and each shard parses its lines and adds up its standings
+ * on its own thread in its own heap, so shards collect independently
+ * and never pause each other. The per-shard standings are then merged
+ * and ranked in the main thread's heap, which is the one that logs
+ * frames.
+ *
+ * It takes the same collector, heap, frame and --bench options as
+ * dkp.exe, plus --shards=N (default 4) and the log file name. Every
+ * shard heap has the --heap size. The bench row adds up the GC counts
+ * and times of all the heaps.
+ */
+
+#define DKP_NO_MAIN
+#include "dkp.cc"
+
+#include <thread>
+
+struct Shard {
+    const char *file_name;
+    long begin;
+    long end;
+    RunOptions *options;
+    long lines;
+    std::vector<std::pair<std::string, int> > standings;
+
+    // collection stats copied out of the shard's heap
+    long gc_count;
+    double gc_seconds;
+    double max_pause_seconds;
+    int max_live_words;
+};
+
+// Finds name in a Vec of (Str, Num) tuples, or returns -1. Names
+// match the way dkp.exe groups them, with Obj::equals, so sharded
+// and unsharded runs rank the same people.
+
+int find_person(VecRef &standings, StrRef name) {
+    for (int i = 0; i < standings.length(); ++i) {
+        if (standings.get(i, 0).equals(name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Adds amount to name's total, adding name if it's new.
+
+void add_to_standing(VecRef &standings, StrRef name, int amount) {
+    int i = find_person(standings, name);
+    if (i < 0) {
+        TupRef person(2);
+        person.set(0, name);
+        person.set(1, NumRef(amount));
+        standings.push(person);
+    }
+    else {
+        TupRef person(standings.get(i));
+        person.set(1, NumRef(person.get(1).to_i() + amount));
+    }
+}
+
+// A shard owns the lines that start in [begin, end).
+
+void run_shard(Shard *shard) {
+    Collector *collector = Collector::named(shard->options->gc_name);
+    Heap *heap = new Heap(collector, shard->options->heap_size, shard->options->capacity());
+    Heap::current = heap;
+    shard->options->configure(heap);
+
+    std::ifstream file(shard->file_name);
+    long pos = shard->begin;
+    std::string data;
+    if (pos > 0) {
+        // the line that crosses begin belongs to the previous shard
+        file.seekg(pos - 1);
+        std::getline(file, data);
+        pos += data.size();
+    }
+    shard->lines = 0;
+    {
+        VecRef standings;
+        while (pos < shard->end && std::getline(file, data)) {
+            pos += data.size() + 1;
+            StrRef line(data);
+            VecRef field(line.split(','));
+            add_to_standing(standings, StrRef(field.get(1)), field.get(0).to_i());
+            shard->lines += 1;
+        }
+        for (int i = 0; i < standings.length(); ++i) {
+            std::string name = StrRef(standings.get(i, 0)).to_s();
+            shard->standings.push_back(std::make_pair(name, (int)standings.get(i, 1).to_i()));
+        }
+    }
+
+    shard->gc_count = heap->gc_count;
+    shard->gc_seconds = heap->gc_seconds;
+    shard->max_pause_seconds = heap->max_pause_seconds;
+    shard->max_live_words = heap->max_live_words;
+    delete heap;
+    delete collector;
+}
+
+int main(int argc, char **argv) {
+    const char *dkp_file_name = "data/dkp.log-small";
+    RunOptions options;
+    int shard_count = 4;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (options.parse(argv[i])) {
+            continue;
+        }
+        else if (arg.compare(0, 9, "--shards=") == 0) {
+            shard_count = atoi(argv[i] + 9);
+        }
+        else {
+            dkp_file_name = argv[i];
+        }
+    }
+    if (shard_count < 1) {
+        std::cerr << "need at least one shard\n";
+        return 1;
+    }
+
+    std::ifstream file(dkp_file_name, std::ios::ate | std::ios::binary);
+    if (!file) {
+        std::cerr << "can't read " << dkp_file_name << '\n';
+        return 1;
+    }
+    long file_size = file.tellg();
+    file.close();
+
+    Heap *heap = start_run(options);
+    if (!heap) {
+        return 1;
+    }
+
+    std::vector<Shard> shards(shard_count);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < shard_count; ++i) {
+        shards[i].file_name = dkp_file_name;
+        shards[i].begin = file_size * i / shard_count;
+        shards[i].end = file_size * (i + 1) / shard_count;
+        shards[i].options = &options;
+        threads.push_back(std::thread(run_shard, &shards[i]));
+    }
+    for (int i = 0; i < shard_count; ++i) {
+        threads[i].join();
+    }
+
+    // merge
+    long lines = 0;
+    VecRef *merged = new VecRef();
+    for (int i = 0; i < shard_count; ++i) {
+        lines += shards[i].lines;
+        for (int j = 0; j < (int)shards[i].standings.size(); ++j) {
+            add_to_standing(*merged, StrRef(shards[i].standings[j].first), shards[i].standings[j].second);
+        }
+        heap->gc_count += shards[i].gc_count;
+        heap->gc_seconds += shards[i].gc_seconds;
+        heap->max_pause_seconds = std::max(heap->max_pause_seconds, shards[i].max_pause_seconds);
+        heap->max_live_words = std::max(heap->max_live_words, shards[i].max_live_words);
+    }
+    heap->log_roots("shards merged");
+
+    // rank by moving the highest remaining total to the front
+    int merged_length = merged->length();
+    for (int i = 0; i < merged_length; ++i) {
+        int best = i;
+        for (int j = i + 1; j < merged_length; ++j) {
+            if (merged->get(j, 1).to_i() > merged->get(best, 1).to_i()) {
+                best = j;
+            }
+        }
+        if (best != i) {
+            ObjRef tmp = merged->get(i);
+            merged->set(i, merged->get(best));
+            merged->set(best, tmp);
+        }
+    }
+
+    heap->log_roots("ranking finished");
+    if (log_ready) {
+        std::cout << "// "; merged->dump(); std::cout << '\n';
+    }
+    finish_run(options, heap, "shards", lines);
+
+    delete merged;
+    return 0;
+}